@@ -64,6 +64,59 @@ bool kdown = false;
 bool kfire = false;
 uint32_t kfire_held_start = 0;
 
+/* Our player and the server's time between ticks, from its welcome, and the
+ * top left of the view. */
+int my_id = -1;
+int tick_ms = DEFAULT_TICK_MS;
+int cam_x = 0;
+int cam_y = 0;
+
+/* Snapshots received recently, which the server may send changes from, and
+ * the newest one shown. */
+struct snapshot_state snapshots[SNAPSHOT_HISTORY];
+uint16_t shown_snapshot = 0;
+
+/* The snapshot each bullet's state is for, and whether it's on
+ * m->live_bullets, which is kept here from the server's bullets unless the
+ * game is stepped in lockstep. */
+uint16_t bullet_seq[MAX_BULLETS];
+bool bullet_listed[MAX_BULLETS];
+
+/* Set once a lockstep server sends the game, which is then stepped here from
+ * the inputs the server sends. in_sync is cleared while waiting for the game
+ * to be sent again. */
+bool lockstep = false;
+bool in_sync = false;
+
+/* Where other tanks and the crate have been, and the difference between the
+ * server's clock and ours. snapshot_tick is the newest snapshot's frame with
+ * the wrapping undone, snapshot_gap the usual time between snapshots, which
+ * depends on how often the server sends them to us. */
+struct interp_buffer tank_interp[MAX_PLAYERS];
+struct interp_buffer crate_interp;
+bool have_clock = false;
+uint32_t snapshot_tick = 0;
+double clock_offset = 0;
+double snapshot_gap = 0;
+
+/* Our tank is moved here as our keys are pressed, a tick at a time, and moved
+ * on again from each position the server sends by the keys held in the ticks
+ * it hasn't stepped yet. predict_tick is the next tick to step, ticks before
+ * predict_from are never replayed because our tank respawned since. */
+uint32_t predict_tick = 0;
+uint32_t predict_from = 0;
+uint32_t predict_time = 0;
+uint8_t tick_keys[PREDICTION_TICKS];
+
+/* Our newest input and the newest the server has applied, the inputs kept
+ * and the tick each was first stepped with, and when they were last sent. */
+uint16_t input_seq = 0;
+uint16_t input_acked = 0;
+uint16_t input_seqs[PREDICTION_TICKS];
+struct input_entry inputs[PREDICTION_TICKS];
+uint32_t input_ticks[PREDICTION_TICKS];
+uint32_t input_sent_time = 0;
+
 void draw_tank(int x, int y, int turretangle, bool facingleft)
 {
     draw_sprite(x, y, COLOR_MOAG_WHITE, tanksprite, TANK_WIDTH, TANK_HEIGHT);
@@ -83,11 +136,12 @@ void draw_crate(int x, int y)
 
 void draw_bullets(struct moag *m)
 {
-    for (int i = 0; i < MAX_BULLETS; i++)
+    for (int i = 0; i < m->num_bullets; i++)
     {
-        struct bullet *b = &m->bullets[i];
+        struct bullet *b = &m->bullets[m->live_bullets[i]];
         if (b->active)
-            draw_sprite(b->x, b->y, COLOR_MOAG_WHITE, bulletsprite, BULLET_WIDTH, BULLET_HEIGHT);
+            draw_sprite(b->x - cam_x, b->y - cam_y, COLOR_MOAG_WHITE,
+                        bulletsprite, BULLET_WIDTH, BULLET_HEIGHT);
     }
 }
 
@@ -121,19 +175,39 @@ void add_chat_line(char* str)
     chatlines[i].expire = SDL_GetTicks() + CHAT_EXPIRETIME;
 }
 
+/* Centers the view on our tank, without showing past the edges of the map. */
+void update_camera(struct moag *m, int view_w, int view_h)
+{
+    if (my_id >= 0 && m->players[my_id].connected)
+    {
+        cam_x = m->players[my_id].tank.x - view_w / 2;
+        cam_y = m->players[my_id].tank.y - view_h / 2;
+    }
+    cam_x = CLAMP(0, m->land.width - view_w, cam_x);
+    cam_y = CLAMP(0, m->land.height - view_h, cam_y);
+}
+
 void draw(struct moag *m)
 {
-    for (int x = 0; x < LAND_WIDTH; ++x)
+    const int view_w = SDL_GetVideoSurface()->w;
+    const int view_h = SDL_GetVideoSurface()->h;
+
+    update_camera(m, view_w, view_h);
+
+    const int right = MIN(cam_x + view_w, m->land.width);
+    for (int y = cam_y; y < cam_y + view_h; ++y)
     {
-        for (int y = 0; y < LAND_HEIGHT; ++y)
+        int x = land_find(&m->land, cam_x, y, 1, true);
+        while (x < right)
         {
-            if (get_land_at(m, x, y))
-                set_pixel(x, y, COLOR_MOAG_GRAY);
+            int end = MIN(land_find(&m->land, x, y, 1, false), right);
+            draw_block(x - cam_x, y - cam_y, end - x, 1, COLOR_MOAG_GRAY);
+            x = land_find(&m->land, end, y, 1, true);
         }
     }
 
     if (m->crate.active)
-        draw_crate(m->crate.x-4,m->crate.y-8);
+        draw_crate(m->crate.x - 4 - cam_x, m->crate.y - 8 - cam_y);
 
     draw_bullets(m);
 
@@ -141,12 +215,12 @@ void draw(struct moag *m)
     {
         if (m->players[i].connected)
         {
-            draw_tank(m->players[i].tank.x - 9,
-                      m->players[i].tank.y - 13,
+            draw_tank(m->players[i].tank.x - 9 - cam_x,
+                      m->players[i].tank.y - 13 - cam_y,
                       m->players[i].tank.angle,
                       m->players[i].tank.facingleft);
-            draw_string_centered(m->players[i].tank.x,
-                                 m->players[i].tank.y - 36,
+            draw_string_centered(m->players[i].tank.x - cam_x,
+                                 m->players[i].tank.y - 36 - cam_y,
                                  COLOR_MOAG_WHITE,
                                  m->players[i].name);
         }
@@ -156,11 +230,11 @@ void draw(struct moag *m)
     {
         if (kfire && SDL_GetTicks() - kfire_held_start >= (i * 200))
         {
-            draw_block(LAND_WIDTH / 2 - 75 + i * 10, LAND_HEIGHT - 17, 10, 7, COLOR_MOAG_LIGHT_GRAY);
+            draw_block(view_w / 2 - 75 + i * 10, view_h - 17, 10, 7, COLOR_MOAG_LIGHT_GRAY);
         }
         else
         {
-            draw_block(LAND_WIDTH / 2 - 75 + i * 10, LAND_HEIGHT - 16, 10, 5, COLOR_MOAG_DARK_GRAY);
+            draw_block(view_w / 2 - 75 + i * 10, view_h - 16, 10, 5, COLOR_MOAG_DARK_GRAY);
         }
     }
 
@@ -181,17 +255,322 @@ void draw(struct moag *m)
     }
 }
 
-void on_receive(struct moag *m, ENetEvent *ev)
+void set_tank_angle(struct tank *t, char angle)
+{
+    t->facingleft = false;
+    if (angle < 0){
+        angle = -angle;
+        t->facingleft = true;
+    }
+    t->angle = angle;
+}
+
+static void add_interp_sample(struct interp_buffer *buf, double ms, const struct entity_state *e)
+{
+    if (buf->count && ms <= buf->samples[buf->count - 1].ms)
+        return;
+    if (buf->count == INTERP_SAMPLES)
+        memmove(buf->samples, buf->samples + 1, --buf->count * sizeof *buf->samples);
+
+    struct interp_sample *s = &buf->samples[buf->count++];
+    s->ms = ms;
+    s->x = e->x;
+    s->y = e->y;
+    s->angle = e->angle;
+}
+
+/* Where an entity was at ms, between the samples either side of it. Returns
+ * false if there are no samples yet. */
+static bool interp_at(const struct interp_buffer *buf, double ms, struct interp_sample *out)
+{
+    if (!buf->count)
+        return false;
+
+    const struct interp_sample *a = &buf->samples[0];
+    const struct interp_sample *b = &buf->samples[buf->count - 1];
+    if (ms <= a->ms || buf->count == 1)
+    {
+        *out = ms <= a->ms ? *a : *b;
+        return true;
+    }
+
+    if (ms >= b->ms)
+    {
+        /* Carried on along the last two samples' motion, for a while. */
+        a = b - 1;
+        ms = MIN(ms, b->ms + INTERP_EXTRAPOLATE_MS);
+    }
+    else
+    {
+        int i = buf->count - 2;
+        while (buf->samples[i].ms > ms)
+            i--;
+        a = &buf->samples[i];
+        b = a + 1;
+    }
+
+    double t = (ms - a->ms) / (b->ms - a->ms);
+    out->ms = ms;
+    out->x = (int)lround(a->x + (b->x - a->x) * t);
+    out->y = (int)lround(a->y + (b->y - a->y) * t);
+    /* Turning around isn't something to blend. */
+    if ((a->angle < 0) == (b->angle < 0))
+        out->angle = (int)lround(a->angle + (b->angle - a->angle) * MIN(t, 1.0));
+    else
+        out->angle = t < 0.5 ? a->angle : b->angle;
+    return true;
+}
+
+/* Forgets where everything has been, for entities that appear elsewhere. */
+void reset_interp(void)
+{
+    for (int i = 0; i < MAX_PLAYERS; i++)
+        tank_interp[i].count = 0;
+    crate_interp.count = 0;
+    have_clock = false;
+}
+
+/* Keeps what a snapshot has for other tanks and the crate to be drawn when
+ * their time comes, and moves our own tank straight away. Which entities
+ * exist is still up to the reliable SPAWN and KILL chunks. */
+void show_snapshot(struct moag *m, const struct snapshot_state *s)
+{
+    if (!have_clock)
+    {
+        snapshot_tick = s->tick;
+        snapshot_gap = tick_ms;
+    }
+    else
+    {
+        int16_t ticks = s->tick - (uint16_t)snapshot_tick;
+        snapshot_tick += ticks;
+        snapshot_gap += (ticks * tick_ms - snapshot_gap) / 8;
+    }
+    double ms = (double)snapshot_tick * tick_ms;
+
+    /* The clocks are compared every snapshot, a little at a time so one
+     * that's late doesn't jerk everything back. */
+    double offset = ms - SDL_GetTicks();
+    if (!have_clock || fabs(offset - clock_offset) > 1000)
+        clock_offset = offset;
+    else
+        clock_offset += (offset - clock_offset) / 16;
+    have_clock = true;
+
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        if (!s->tanks[i].present)
+            continue;
+        if (i == my_id)
+        {
+            m->players[i].tank.x = s->tanks[i].x;
+            m->players[i].tank.y = s->tanks[i].y;
+            set_tank_angle(&m->players[i].tank, s->tanks[i].angle);
+        }
+        else
+        {
+            add_interp_sample(&tank_interp[i], ms, &s->tanks[i]);
+        }
+    }
+    if (s->crate.present)
+        add_interp_sample(&crate_interp, ms, &s->crate);
+}
+
+/* Puts other tanks and the crate where they were INTERP_DELAY_MS ago, or two
+ * snapshots ago if they come less often, so there's one to go to when the
+ * next is lost. */
+void interpolate_entities(struct moag *m)
+{
+    if (!have_clock)
+        return;
+
+    double ms = SDL_GetTicks() + clock_offset - MAX(INTERP_DELAY_MS, 2 * snapshot_gap);
+    struct interp_sample s;
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        if (i == my_id || !interp_at(&tank_interp[i], ms, &s))
+            continue;
+        m->players[i].tank.x = s.x;
+        m->players[i].tank.y = s.y;
+        set_tank_angle(&m->players[i].tank, s.angle);
+    }
+    if (interp_at(&crate_interp, ms, &s))
+    {
+        m->crate.x = s.x;
+        m->crate.y = s.y;
+    }
+}
+
+/* Flies a bullet on to where it is at snapshot seq, the server only sends
+ * bullets when they're fired or knocked off course. */
+void fly_bullet(struct moag *m, int id, uint16_t seq)
+{
+    while (seq_after(seq, bullet_seq[id]))
+    {
+        bullet_fly(&m->bullets[id]);
+        bullet_seq[id] = next_seq(bullet_seq[id]);
+    }
+}
+
+/* Flies every bullet on to snapshot seq, and unlists the killed ones. */
+void fly_bullets(struct moag *m, uint16_t seq)
+{
+    int kept = 0;
+    for (int i = 0; i < m->num_bullets; i++)
+    {
+        int id = m->live_bullets[i];
+        if (!m->bullets[id].active)
+        {
+            bullet_listed[id] = false;
+            continue;
+        }
+        fly_bullet(m, id, seq);
+        m->live_bullets[kept++] = id;
+    }
+    m->num_bullets = kept;
+}
+
+static uint8_t held_keys(const struct player *p)
+{
+    return p->kleft | p->kright << 1 | p->kup << 2 | p->kdown << 3;
+}
+
+static void hold_keys(struct player *p, uint8_t keys)
+{
+    p->kleft = keys & 1;
+    p->kright = keys & 2;
+    p->kup = keys & 4;
+    p->kdown = keys & 8;
+}
+
+/* Sends every input the server hasn't applied yet, oldest first, so any
+ * that were lost go again with the newest. */
+void send_inputs(void)
+{
+    if (input_seq == input_acked)
+        return;
+
+    /* Inputs too old to be kept are gone for good. */
+    uint16_t first = next_seq(input_acked);
+    while (input_seqs[first % PREDICTION_TICKS] != first && first != input_seq)
+        first = next_seq(first);
+
+    struct input_entry pending[MAX_INPUTS_PER_CHUNK];
+    int n = 0;
+    for (uint16_t seq = first; n < MAX_INPUTS_PER_CHUNK; seq = next_seq(seq))
+    {
+        pending[n++] = inputs[seq % PREDICTION_TICKS];
+        if (seq == input_seq)
+            break;
+    }
+    send_input_chunk(first, pending, n);
+    input_sent_time = SDL_GetTicks();
+}
+
+/* Inputs the server hasn't acknowledged are sent again every tick. */
+void resend_inputs(void)
+{
+    if (input_seq != input_acked && SDL_GetTicks() - input_sent_time >= (uint32_t)tick_ms)
+        send_inputs();
+}
+
+void ack_inputs(uint16_t seq)
+{
+    if (seq_after(seq, input_acked) && !seq_after(seq, input_seq))
+        input_acked = seq;
+}
+
+/* Sends an input, and applies it to our tank straight away unless the game
+ * is stepped in lockstep, where it's only applied once the server says so. */
+void send_input(struct moag *m, int key, uint16_t ms)
 {
-    struct chunk_header *chunk;
+    input_seq = next_seq(input_seq);
+    input_seqs[input_seq % PREDICTION_TICKS] = input_seq;
+    inputs[input_seq % PREDICTION_TICKS].key = key;
+    inputs[input_seq % PREDICTION_TICKS].ms = ms;
+    input_ticks[input_seq % PREDICTION_TICKS] = predict_tick;
+    send_inputs();
+
+    if (lockstep || my_id < 0)
+        return;
+    game_input(m, my_id, key, ms);
+}
+
+/* Steps our tank for each tick that's passed, at the server's tick rate. */
+void predict_ticks(struct moag *m)
+{
+    uint32_t now = SDL_GetTicks();
+
+    /* Ticks missed while the window was held up aren't made up. */
+    if (now - predict_time > PREDICTION_TICKS * tick_ms)
+        predict_time = now - tick_ms;
+
+    while (now - predict_time >= tick_ms)
+    {
+        predict_time += tick_ms;
+        if (lockstep || my_id < 0)
+            continue;
+
+        tick_keys[predict_tick % PREDICTION_TICKS] = held_keys(&m->players[my_id]);
+        if (m->players[my_id].connected)
+            tank_move(m, my_id);
+        predict_tick++;
+    }
+}
 
-    chunk = receive_chunk(ev->packet);
+/* A snapshot put our tank where the server had it after input_seq and
+ * input_ticks more ticks. Moves it on by the keys held in the ticks since,
+ * which the server hasn't stepped yet or had other keys for. */
+void replay_ticks(struct moag *m, uint16_t seq, uint16_t ticks)
+{
+    if (lockstep || my_id < 0 || !m->players[my_id].connected)
+        return;
+    /* Without a kept input to count from, the server's position is kept. */
+    if (input_seqs[seq % PREDICTION_TICKS] != seq || ticks == UINT16_MAX)
+        return;
+
+    struct player *p = &m->players[my_id];
+    uint32_t from = input_ticks[seq % PREDICTION_TICKS] + ticks;
+    if ((int32_t)(from - predict_from) < 0)
+        from = predict_from;
+
+    /* The server has stepped further than we have, so we skip ahead to it
+     * rather than stepping our tank past it. */
+    if ((int32_t)(from - predict_tick) > 0)
+    {
+        while (predict_tick != from)
+            tick_keys[predict_tick++ % PREDICTION_TICKS] = held_keys(p);
+        return;
+    }
+    if (predict_tick - from > PREDICTION_TICKS)
+        return;
 
+    uint8_t held = held_keys(p);
+    for (uint32_t t = from; t != predict_tick; t++)
+    {
+        hold_keys(p, tick_keys[t % PREDICTION_TICKS]);
+        tank_move(m, my_id);
+    }
+    hold_keys(p, held);
+}
+
+/* Lockstep clients step the game themselves, only its notices are shown,
+ * everything else is drawn straight from it. */
+void show_notices(struct moag *m)
+{
+    for (int i = 0; i < m->num_events; i++)
+        if (m->events[i].type == EVENT_NOTICE)
+            add_chat_line(string_duplicate(m->events[i].notice));
+    clear_game_events(m);
+}
+
+void handle_chunk(struct moag *m, struct chunk *chunk)
+{
     switch (chunk->type)
     {
         case LAND_CHUNK:
         {
-            struct land_chunk *land = (void *)chunk;
+            struct land_chunk *land = &chunk->land;
             int i = 0;
             for (int y = land->y; y < land->height + land->y; ++y)
             {
@@ -201,112 +580,90 @@ void on_receive(struct moag *m, ENetEvent *ev)
                     i++;
                 }
             }
+            land_compact(&m->land, land->x, land->y, land->width, land->height);
             break;
         }
 
         case PACKED_LAND_CHUNK:
         {
-            struct packed_land_chunk *land = (void *)chunk;
-            const size_t packed_len = ev->packet->dataLength - sizeof(struct packed_land_chunk);
-            size_t datalen = 0;
-            uint8_t *data = rldecode(land->data, packed_len, &datalen);
-
-            int i = 0;
-            for (int y = land->y; y < land->height + land->y; ++y)
-            {
-                if (i >= datalen) break;
-                for (int x = land->x; x < land->width + land->x; ++x)
-                {
-                    set_land_at(m, x, y, data[i]);
-                    i++;
-                    if (i >= datalen) break;
-                }
-            }
-
-            free(data);
+            struct land_chunk *land = &chunk->land;
+            unpack_land(m, land->x, land->y, land->width, land->height, land->data, land->len);
             break;
         }
 
         case TANK_CHUNK:
         {
-            struct tank_chunk *tank = (void *)chunk;
+            struct tank_chunk *tank = &chunk->tank;
             int id = tank->id;
 
-            assert(id >= 0 && id <= MAX_PLAYERS);
-
             if (tank->action == SPAWN)
             {
                 m->players[id].connected = true;
 
                 m->players[id].tank.x = tank->x;
                 m->players[id].tank.y = tank->y;
-                char angle = tank->angle;
+                set_tank_angle(&m->players[id].tank, tank->angle);
 
-                m->players[id].tank.facingleft = false;
-                if (angle < 0){
-                    angle = -angle;
-                    m->players[id].tank.facingleft = true;
+                /* The server lets go of a respawned tank's keys, and where
+                 * it was before is no use to replay from. */
+                if (id == my_id)
+                {
+                    hold_keys(&m->players[id], 0);
+                    predict_from = predict_tick;
                 }
-                m->players[id].tank.angle = angle;
+                tank_interp[id].count = 0;
             }
             else if (tank->action == MOVE)
             {
                 m->players[id].tank.x = tank->x;
                 m->players[id].tank.y = tank->y;
-                char angle = tank->angle;
-
-                m->players[id].tank.facingleft = false;
-                if (angle < 0){
-                    angle = -angle;
-                    m->players[id].tank.facingleft = true;
-                }
-                m->players[id].tank.angle = angle;
+                set_tank_angle(&m->players[id].tank, tank->angle);
             }
             else if (tank->action == KILL)
             {
                 m->players[id].tank.x = -1;
                 m->players[id].tank.y = -1;
                 m->players[id].connected = false;
-            }
-            else
-            {
-                DIE("Invalid TANK_CHUNK type.\n");
+                tank_interp[id].count = 0;
             }
             break;
         }
 
         case BULLET_CHUNK:
         {
-            struct bullet_chunk *bullet = (void *)chunk;
+            struct bullet_chunk *bullet = &chunk->bullet;
             int id = bullet->id;
 
-            if (bullet->action == SPAWN)
-            {
-                m->bullets[id].active = true;
-                m->bullets[id].x = bullet->x;
-                m->bullets[id].y = bullet->y;
-            }
-            else if (bullet->action == MOVE)
+            if (bullet->action == SPAWN || bullet->action == MOVE)
             {
-                m->bullets[id].x = bullet->x;
-                m->bullets[id].y = bullet->y;
+                struct bullet *b = &m->bullets[id];
+                if (!bullet_listed[id])
+                {
+                    bullet_listed[id] = true;
+                    m->live_bullets[m->num_bullets++] = id;
+                }
+                b->active = true;
+                b->type = bullet->type;
+                b->obj.pos = VEC2(bullet->x, bullet->y);
+                b->obj.vel = VEC2(bullet->vx, bullet->vy);
+                b->x = (int)b->obj.pos.x;
+                b->y = (int)b->obj.pos.y;
+                bullet_seq[id] = bullet->seq;
+                if (shown_snapshot)
+                    fly_bullet(m, id, shown_snapshot);
             }
             else if (bullet->action == KILL)
             {
                 m->bullets[id].active = false;
             }
-            else
-            {
-                DIE("Invalid BULLET_CHUNK type.\n");
-            }
             break;
         }
 
         case SERVER_MSG_CHUNK:
         {
-            struct server_msg_chunk *server_msg = (void *)chunk;
+            struct server_msg_chunk *server_msg = &chunk->server_msg;
             int id = server_msg->id;
-            unsigned char len = ev->packet->dataLength - sizeof(struct server_msg_chunk);
+            unsigned char len = server_msg->len;
 
             switch (server_msg->action)
             {
@@ -342,22 +699,20 @@ void on_receive(struct moag *m, ENetEvent *ev)
                     add_chat_line(string_duplicate((char *)server_msg->data));
                     break;
                 }
-
-                default:
-                    DIE("Invalid SERVER_MSG_CHUNK action (%d).\n", server_msg->action);
             }
             break;
         }
 
         case CRATE_CHUNK:
         {
-            struct crate_chunk *crate = (void *)chunk;
+            struct crate_chunk *crate = &chunk->crate;
 
             if (crate->action == SPAWN)
             {
                 m->crate.active = true;
                 m->crate.x = crate->x;
                 m->crate.y = crate->y;
+                crate_interp.count = 0;
             }
             else if (crate->action == MOVE)
             {
@@ -368,18 +723,136 @@ void on_receive(struct moag *m, ENetEvent *ev)
             {
                 m->crate.active = false;
             }
-            else
+            break;
+        }
+
+        case WELCOME_CHUNK:
+        {
+            struct welcome_chunk *welcome = &chunk->welcome;
+
+            my_id = welcome->id;
+            tick_ms = welcome->tick_ms;
+            /* Until our first input the server counts ticks from joining. */
+            predict_from = predict_tick;
+            input_seqs[0] = 0;
+            input_ticks[0] = predict_tick;
+            memset(snapshots, 0, sizeof snapshots);
+            shown_snapshot = 0;
+            reset_interp();
+            land_free(&m->land);
+            land_init(&m->land, welcome->width, welcome->height);
+            resize_window(MIN(welcome->width, VIEW_WIDTH),
+                          MIN(welcome->height, VIEW_HEIGHT));
+            break;
+        }
+
+        case GAME_STATE_CHUNK:
+        {
+            struct game_state_chunk *state = &chunk->game_state;
+
+            in_sync = read_game_state(m, state->data, state->len);
+            if (!in_sync)
+                ERR("Dropped a malformed game state.\n");
+            lockstep = true;
+            break;
+        }
+
+        case INPUT_BUNDLE_CHUNK:
+        {
+            struct input_bundle_chunk *bundle = &chunk->input_bundle;
+
+            /* Our own inputs in it have been applied, in the order we sent
+             * them, even if our game hasn't caught up with them yet. */
+            size_t pos = 0;
+            struct input_bundle_entry e;
+            while (pos < bundle->len)
+            {
+                read_bundle_entry(bundle, &pos, &e);
+                if (e.type == BUNDLE_INPUT && e.id == my_id)
+                    ack_inputs(next_seq(input_acked));
+            }
+
+            /* Bundles from before the game was sent are already in it. */
+            if (!in_sync || bundle->frame != (uint32_t)m->frame)
+                break;
+
+            pos = 0;
+            while (pos < bundle->len)
             {
-                DIE("Invalid CRATE_CHUNK type.\n");
+                read_bundle_entry(bundle, &pos, &e);
+                if (e.type == BUNDLE_INPUT)
+                    game_input(m, e.id, e.key, e.ms);
+                else if (e.type == BUNDLE_JOIN)
+                    game_join(m, e.id);
+                else
+                    game_leave(m, e.id);
+            }
+
+            if (bundle->checksum && game_checksum(m) != bundle->checksum)
+            {
+                ERR("Out of sync at frame %u, asking for the game again.\n",
+                    (unsigned)bundle->frame);
+                in_sync = false;
+                send_state_request_chunk();
+                break;
+            }
+
+            step_game(m);
+            show_notices(m);
+            clear_land_dirty(m);
+            break;
+        }
+
+        case SNAPSHOT_CHUNK:
+        {
+            struct snapshot_chunk *snapshot = &chunk->snapshot;
+            const struct snapshot_state *base = NULL;
+
+            /* Changes from a snapshot that's no longer kept can't be used. */
+            if (snapshot->baseline)
+            {
+                base = &snapshots[snapshot->baseline % SNAPSHOT_HISTORY];
+                if (base->seq != snapshot->baseline)
+                    break;
+            }
+
+            struct snapshot_state s;
+            if (!read_snapshot(snapshot, base, &s))
+            {
+                ERR("Dropped a malformed snapshot.\n");
+                break;
+            }
+            snapshots[s.seq % SNAPSHOT_HISTORY] = s;
+            send_snapshot_ack_chunk(s.seq);
+            ack_inputs(snapshot->input_seq);
+
+            if (!shown_snapshot || seq_after(s.seq, shown_snapshot))
+            {
+                shown_snapshot = s.seq;
+                show_snapshot(m, &s);
+                replay_ticks(m, snapshot->input_seq, snapshot->input_ticks);
+                fly_bullets(m, s.seq);
             }
             break;
         }
 
         default:
-            DIE("Invalid CHUNK type (%d).\n", chunk->type);
+            ERR("Unexpected CHUNK type (%d).\n", chunk->type);
+            break;
     }
+}
+
+void on_receive(struct moag *m, ENetEvent *ev)
+{
+    struct chunk chunk;
 
-    free(chunk);
+    if (!receive_chunk(ev->packet, &chunk))
+    {
+        ERR("Dropped a malformed packet (%zu bytes).\n", ev->packet->dataLength);
+        return;
+    }
+
+    handle_chunk(m, &chunk);
 }
 
 int main(int argc, char *argv[])
@@ -390,7 +863,8 @@ int main(int argc, char *argv[])
     }
 
     init_enet_client(argv[1], PORT);
-    init_sdl(LAND_WIDTH, LAND_HEIGHT, "MOAG");
+    init_sdl(MIN(DEFAULT_LAND_WIDTH, VIEW_WIDTH),
+             MIN(DEFAULT_LAND_HEIGHT, VIEW_HEIGHT), "MOAG");
 
     if (!set_font("Nouveau_IBM.ttf", 14))
         DIE("Failed to open 'Nouveau_IBM.ttf'\n");
@@ -398,6 +872,7 @@ int main(int argc, char *argv[])
     struct moag moag;
 
     memset(&moag, 0, sizeof(moag));
+    land_init(&moag.land, DEFAULT_LAND_WIDTH, DEFAULT_LAND_HEIGHT);
 
     ENetEvent enet_ev;
 
@@ -418,17 +893,8 @@ int main(int argc, char *argv[])
             }
             else if (is_key_down(SDLK_RETURN))
             {
-                // length of typing_str including null + sizeof(client_msg_chunk)
-                unsigned char buffer[257];
-                size_t pos = 0;
-
-                unsigned char len = strlen(typing_str)+1;
-                write8(buffer, &pos, CLIENT_MSG_CHUNK);
-                //write8(buffer, &pos, len);
-                for (int i = 0; i < len; ++i)
-                    write8(buffer, &pos, typing_str[i]);
-
-                send_packet(buffer, pos, false, true);
+                // length of typing_str including null
+                send_client_msg_chunk(typing_str, strlen(typing_str) + 1);
 
                 stop_text_input();
                 typing_str = NULL;
@@ -439,57 +905,57 @@ int main(int argc, char *argv[])
         {
             if (is_key_down(SDLK_LEFT) && !kleft)
             {
-                send_input_chunk(KLEFT_PRESSED, 0);
+                send_input(&moag, KLEFT_PRESSED, 0);
                 kleft = true;
             }
             else if (!is_key_down(SDLK_LEFT) && kleft)
             {
-                send_input_chunk(KLEFT_RELEASED, 0);
+                send_input(&moag, KLEFT_RELEASED, 0);
                 kleft = false;
             }
 
             if (is_key_down(SDLK_RIGHT) && !kright)
             {
-                send_input_chunk(KRIGHT_PRESSED, 0);
+                send_input(&moag, KRIGHT_PRESSED, 0);
                 kright = true;
             }
             else if (!is_key_down(SDLK_RIGHT) && kright)
             {
-                send_input_chunk(KRIGHT_RELEASED, 0);
+                send_input(&moag, KRIGHT_RELEASED, 0);
                 kright = false;
             }
 
             if (is_key_down(SDLK_UP) && !kup)
             {
-                send_input_chunk(KUP_PRESSED, 0);
+                send_input(&moag, KUP_PRESSED, 0);
                 kup = true;
             }
             else if (!is_key_down(SDLK_UP) && kup)
             {
-                send_input_chunk(KUP_RELEASED, 0);
+                send_input(&moag, KUP_RELEASED, 0);
                 kup = false;
             }
 
             if (is_key_down(SDLK_DOWN) && !kdown)
             {
-                send_input_chunk(KDOWN_PRESSED, 0);
+                send_input(&moag, KDOWN_PRESSED, 0);
                 kdown = true;
             }
             else if (!is_key_down(SDLK_DOWN) && kdown)
             {
-                send_input_chunk(KDOWN_RELEASED, 0);
+                send_input(&moag, KDOWN_RELEASED, 0);
                 kdown = false;
             }
 
             if (is_key_down(' ') && !kfire)
             {
-                send_input_chunk(KFIRE_PRESSED, 0);
+                send_input(&moag, KFIRE_PRESSED, 0);
                 kfire = true;
                 kfire_held_start = SDL_GetTicks();
             }
             else if (!is_key_down(' ') && kfire)
             {
-                send_input_chunk(KFIRE_RELEASED, SDL_GetTicks() - kfire_held_start);
+                send_input(&moag, KFIRE_RELEASED, SDL_GetTicks() - kfire_held_start);
                 kfire = false;
                 kfire_held_start = 0;
             }
@@ -526,11 +992,15 @@ int main(int argc, char *argv[])
             }
         }
 
+        resend_inputs();
+        predict_ticks(&moag);
+        interpolate_entities(&moag);
+
         SDL_FillRect(SDL_GetVideoSurface(), NULL, COLOR_BLACK);
         draw(&moag);
         char buf[256];
         sprintf(buf, "%u", get_peer()->roundTripTime);
-        draw_string_right(LAND_WIDTH, 0, COLOR_GREEN, buf);
+        draw_string_right(SDL_GetVideoSurface()->w, 0, COLOR_GREEN, buf);
         SDL_Flip(SDL_GetVideoSurface());
     }
 
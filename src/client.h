@@ -3,6 +3,8 @@
 #define CLIENT_H
 
 #include "common.h"
+#include "game.h"
+#include "net.h"
 #include "sdl_aux.h"
 #include "moag.h"
 
@@ -10,22 +12,90 @@
 #define CHAT_LINES      7
 #define CHAT_EXPIRETIME 18000
 
+/* Largest part of the map shown at once, the window is smaller for smaller
+ * maps. */
+#define VIEW_WIDTH      800
+#define VIEW_HEIGHT     600
+
+/* Ticks of our own keys kept for moving our tank on from where the server
+ * last had it, and inputs kept to find where to start from. */
+#define PREDICTION_TICKS 256
+
+/* Other tanks and the crate are drawn at least this far behind the server,
+ * between the last INTERP_SAMPLES positions snapshots gave them. When
+ * snapshots are late they're carried on along their last motion for at most
+ * INTERP_EXTRAPOLATE_MS, and then held. */
+#define INTERP_DELAY_MS         50
+#define INTERP_EXTRAPOLATE_MS   50
+#define INTERP_SAMPLES          16
+
 struct chatline
 {
     int expire;
     char *str;
 };
 
-static inline void send_input_chunk(int key, uint16_t t)
+/* An entity's position at a time on the server's clock, in ms. */
+struct interp_sample
+{
+    double ms;
+    int x, y;
+    int angle;
+};
+
+/* Oldest first. */
+struct interp_buffer
+{
+    struct interp_sample samples[INTERP_SAMPLES];
+    int count;
+};
+
+static inline void send_input_chunk(uint16_t seq, const struct input_entry *inputs, int n)
+{
+    size_t pos = 0;
+    ENetPacket *packet = create_packet(INPUT_CHUNK_HEADER_SIZE + n * INPUT_ENTRY_SIZE, false);
+    write8(packet->data, &pos, INPUT_CHUNK);
+    write16(packet->data, &pos, seq);
+    for (int i = 0; i < n; i++)
+    {
+        write8(packet->data, &pos, inputs[i].key);
+        write16(packet->data, &pos, inputs[i].ms);
+    }
+    send_packet(CHANNEL_STATE, packet);
+
+    LOG("%u: %s: %zu\n", (unsigned)time(NULL), __PRETTY_FUNCTION__, pos);
+}
+
+static inline void send_client_msg_chunk(const char *msg, unsigned char len)
+{
+    size_t pos = 0;
+    ENetPacket *packet = create_packet(CLIENT_MSG_CHUNK_HEADER_SIZE + len, true);
+    write8(packet->data, &pos, CLIENT_MSG_CHUNK);
+    write_bytes(packet->data, &pos, msg, len);
+    send_packet(CHANNEL_CHAT, packet);
+
+    LOG("%u: %s: %zu\n", (unsigned)time(NULL), __PRETTY_FUNCTION__, pos);
+}
+
+static inline void send_snapshot_ack_chunk(uint16_t seq)
 {
-    struct input_chunk chunk;
-    chunk._.type = INPUT_CHUNK;
-    chunk.key = key;
-    chunk.ms = t;
+    size_t pos = 0;
+    ENetPacket *packet = create_packet(SNAPSHOT_ACK_CHUNK_SIZE, false);
+    write8(packet->data, &pos, SNAPSHOT_ACK_CHUNK);
+    write16(packet->data, &pos, seq);
+    send_packet(CHANNEL_STATE, packet);
 
-    send_chunk((void *)&chunk, sizeof chunk, false, true);
+    LOG("%u: %s: %zu\n", (unsigned)time(NULL), __PRETTY_FUNCTION__, pos);
+}
+
+static inline void send_state_request_chunk(void)
+{
+    size_t pos = 0;
+    ENetPacket *packet = create_packet(STATE_REQUEST_CHUNK_SIZE, true);
+    write8(packet->data, &pos, STATE_REQUEST_CHUNK);
+    send_packet(CHANNEL_WORLD, packet);
 
-    LOG("%u: %s: %zu\n", (unsigned)time(NULL), __PRETTY_FUNCTION__, sizeof chunk);
+    LOG("%u: %s: %zu\n", (unsigned)time(NULL), __PRETTY_FUNCTION__, pos);
 }
 
 #endif
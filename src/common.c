@@ -4,6 +4,10 @@
 
 #include "common.h"
 
+#ifdef WIN32
+#include <windows.h>
+#endif
+
 static void (*safe_malloc_callback) (int error_number, size_t requested);
 
 void safe_malloc_set_callback(void (*callback) (int, size_t))
@@ -48,398 +52,370 @@ char *string_duplicate(const char *str)
     return s;
 }
 
-/******************************************************************************\
-\******************************************************************************/
-
-// convenience hack for old enet support
-#if !defined(ENET_VERSION_MAJOR) || (ENET_VERSION_MAJOR == 1 && ENET_VERSION_MINOR == 2)
-#define OLD_ENET
-#endif
-
-static bool _initialized = false;
-
-static ENetHost *_client = NULL;
-static ENetHost *_server = NULL;
-static ENetPeer *_peer = NULL;
-
-void init_enet_client(const char *ip, unsigned port)
+uint64_t monotonic_us(void)
 {
-    if (!_initialized)
-    {
-        if (enet_initialize() != 0)
-            DIE("An error occurred while initializing ENet.\n");
-        else
-            atexit(enet_deinitialize);
-    }
-    _initialized = true;
-
-#ifdef OLD_ENET
-    _client = enet_host_create(NULL, MAX_CLIENTS, 0, 0);
+#ifdef WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000 +
+           (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
 #else
-    _client = enet_host_create(NULL, MAX_CLIENTS, NUM_CHANNELS, 0, 0);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 #endif
-    if (!_client)
-        DIE("An error occurred while trying to create an ENet client host.\n");
-
-    ENetAddress address;
-    enet_address_set_host(&address, ip);
-    address.port = port;
+}
 
-#ifdef OLD_ENET
-    _peer = enet_host_connect(_client, &address, NUM_CHANNELS);
-#else
-    _peer = enet_host_connect(_client, &address, NUM_CHANNELS, 0);
-#endif
-    if (!_peer)
-        DIE("No available peers for initiating an ENet connection.\n");
+/******************************************************************************\
+\******************************************************************************/
 
-    ENetEvent ev;
+static bool is_terminated(const uint8_t *data, size_t len)
+{
+    return len > 0 && memchr(data, '\0', len) != NULL;
+}
 
-    if (enet_host_service(_client, &ev, CONNECT_TIMEOUT) == 0 ||
-        ev.type != ENET_EVENT_TYPE_CONNECT)
-    {
-        enet_peer_reset(_peer);
-        DIE("Connection to %s timed out.\n", ip);
-    }
+static bool is_action(uint8_t action)
+{
+    return action == SPAWN || action == KILL || action == MOVE;
 }
 
-void init_enet_server(unsigned port)
+/* One entity's changes in a snapshot. x and y are changes or new values
+ * depending on the fields. */
+struct snapshot_entry
 {
-    if (!_initialized)
+    uint8_t type;
+    uint8_t id;
+    uint8_t fields;
+    int x, y;
+    int8_t angle;
+};
+
+static bool decode_snapshot_entry(const uint8_t *data, size_t len, size_t *pos,
+                                  struct snapshot_entry *e)
+{
+    if (len - *pos < 3)
+        return false;
+
+    e->type = read8(data, pos);
+    e->id = read8(data, pos);
+    e->fields = read8(data, pos);
+
+    const uint8_t f = e->fields;
+    size_t need = ((f & SNAP_X8) ? 1 : 0) + ((f & SNAP_X16) ? 2 : 0) +
+                  ((f & SNAP_Y8) ? 1 : 0) + ((f & SNAP_Y16) ? 2 : 0) +
+                  ((f & SNAP_ANGLE) ? 1 : 0);
+
+    if (f & ~(SNAP_X8 | SNAP_X16 | SNAP_Y8 | SNAP_Y16 | SNAP_ANGLE | SNAP_GONE) ||
+        ((f & SNAP_X8) && (f & SNAP_X16)) ||
+        ((f & SNAP_Y8) && (f & SNAP_Y16)) ||
+        ((f & SNAP_GONE) && f != SNAP_GONE) ||
+        len - *pos < need)
     {
-        if (enet_initialize() != 0)
-            DIE("An error occurred while initializing ENet.\n");
-        else
-            atexit(enet_deinitialize);
+        return false;
     }
-    _initialized = true;
 
-    ENetAddress address;
-    address.host = ENET_HOST_ANY;
-    address.port = port;
+    e->x = (f & SNAP_X8) ? (int8_t)read8(data, pos) :
+           (f & SNAP_X16) ? read16(data, pos) : 0;
+    e->y = (f & SNAP_Y8) ? (int8_t)read8(data, pos) :
+           (f & SNAP_Y16) ? read16(data, pos) : 0;
+    e->angle = (f & SNAP_ANGLE) ? (int8_t)read8(data, pos) : 0;
 
-#ifdef OLD_ENET
-    _server = enet_host_create(&address, MAX_CLIENTS, 0, 0);
-#else
-    _server = enet_host_create(&address, MAX_CLIENTS, NUM_CHANNELS, 0, 0);
-#endif
-    if (!_server)
-        DIE("An error occurred while trying to create an ENet server host.\n");
+    switch (e->type)
+    {
+        case TANK_CHUNK:
+            return e->id < MAX_PLAYERS;
+        case CRATE_CHUNK:
+            return e->id == 0 && !(f & SNAP_ANGLE);
+        default:
+            return false;
+    }
 }
 
-void uninit_enet(void)
+bool read_snapshot(const struct snapshot_chunk *snapshot,
+                   const struct snapshot_state *base, struct snapshot_state *out)
 {
-    if (_peer)
+    if (base)
+        *out = *base;
+    else
+        memset(out, 0, sizeof *out);
+    out->seq = snapshot->seq;
+    out->tick = snapshot->tick;
+
+    size_t pos = 0;
+    while (pos < snapshot->len)
     {
-        enet_peer_disconnect(_peer, 0);
+        struct snapshot_entry e;
+        if (!decode_snapshot_entry(snapshot->data, snapshot->len, &pos, &e))
+            return false;
 
-        ENetEvent ev;
-        while (enet_host_service(_client, &ev, 3000))
+        struct entity_state *s = e.type == TANK_CHUNK ? &out->tanks[e.id] : &out->crate;
+        if (e.fields & SNAP_GONE)
         {
-            switch (ev.type)
-            {
-            case ENET_EVENT_TYPE_RECEIVE:
-                enet_packet_destroy(ev.packet);
-                break;
-
-            case ENET_EVENT_TYPE_DISCONNECT:
-                goto successfull_disconnect;
-
-            default:
-                break;
-            }
+            memset(s, 0, sizeof *s);
+            continue;
         }
 
-        enet_peer_reset(_peer);
+        s->present = true;
+        if (e.fields & SNAP_X8)
+            s->x += e.x;
+        else if (e.fields & SNAP_X16)
+            s->x = e.x;
+        if (e.fields & SNAP_Y8)
+            s->y += e.y;
+        else if (e.fields & SNAP_Y16)
+            s->y = e.y;
+        if (e.fields & SNAP_ANGLE)
+            s->angle = e.angle;
     }
-
-successfull_disconnect:
-    if (_client)
-        enet_host_destroy(_client);
-    if (_server)
-        enet_host_destroy(_server);
-
-    _client = NULL;
-    _server = NULL;
-    _peer = NULL;
-}
-
-ENetHost *get_client_host(void)
-{
-    return _client;
-}
-
-ENetHost *get_server_host(void)
-{
-    return _server;
+    return true;
 }
 
-ENetPeer *get_peer(void)
-{
-    return _peer;
-}
-
-/******************************************************************************\
-\******************************************************************************/
-
-struct chunk_header *receive_chunk(ENetPacket *packet)
+bool decode_chunk(const uint8_t *data, size_t len, struct chunk *chunk)
 {
     size_t pos = 0;
 
-    struct chunk_header *chunk = safe_malloc(packet->dataLength);
-    if (!chunk)
-        return NULL;
+    if (len < 1)
+        return false;
 
-    chunk->type = read8(packet->data, &pos);
+    chunk->type = read8(data, &pos);
 
     switch (chunk->type)
     {
         case INPUT_CHUNK:
         {
-            struct input_chunk *input = (void *)chunk;
-
-            input->key = read8(packet->data, &pos);
-            input->ms = read16(packet->data, &pos);
-
-            break;
-        }
-
-        case CLIENT_MSG_CHUNK:
-        {
-            struct client_msg_chunk *client_msg = (void *)chunk;
-
-            memcpy(client_msg->data, packet->data + pos, packet->dataLength - pos);
-
-            break;
-        }
+            struct input_chunk *input = &chunk->input;
 
-        case LAND_CHUNK:
-        {
-            struct land_chunk *land = (void *)chunk;
+            if (len < INPUT_CHUNK_HEADER_SIZE)
+                return false;
 
-            land->x = read16(packet->data, &pos);
-            land->y = read16(packet->data, &pos);
-            land->width = read16(packet->data, &pos);
-            land->height = read16(packet->data, &pos);
+            input->seq = read16(data, &pos);
+            input->data = data + pos;
+            input->len = len - pos;
 
-            if (land->width < 0) land->width = 0;
-            if (land->height < 0) land->height = 0;
+            if (input->seq == 0 || input->len == 0 || input->len % INPUT_ENTRY_SIZE ||
+                input->len > MAX_INPUTS_PER_CHUNK * INPUT_ENTRY_SIZE)
+                return false;
 
-            if (land->x < 0 || land->y < 0 ||
-                land->x + land->width > LAND_WIDTH ||
-                land->y + land->height > LAND_HEIGHT)
+            size_t p = 0;
+            struct input_entry e;
+            while (p < input->len)
             {
-                DIE("Bad LAND_CHUNK.");
+                read_input_entry(input, &p, &e);
+                if (e.key > KFIRE_RELEASED)
+                    return false;
             }
+            return true;
+        }
 
-            if (pos == packet->dataLength)
-            {
-                DIE("Bad LAND_CHUNK (Zero-length).\n");
-            }
+        case CLIENT_MSG_CHUNK:
+        {
+            struct client_msg_chunk *client_msg = &chunk->client_msg;
 
-            memcpy(land->data, packet->data + pos, packet->dataLength - pos);
+            client_msg->data = data + pos;
+            client_msg->len = len - pos;
 
-            break;
+            return is_terminated(client_msg->data, client_msg->len);
         }
 
+        case LAND_CHUNK:
         case PACKED_LAND_CHUNK:
         {
-            struct packed_land_chunk *land = (void *)chunk;
+            struct land_chunk *land = &chunk->land;
 
-            land->x = read16(packet->data, &pos);
-            land->y = read16(packet->data, &pos);
-            land->width = read16(packet->data, &pos);
-            land->height = read16(packet->data, &pos);
+            if (len <= LAND_CHUNK_HEADER_SIZE)
+                return false;
 
-            if (land->width < 0) land->width = 0;
-            if (land->height < 0) land->height = 0;
+            land->x = read16(data, &pos);
+            land->y = read16(data, &pos);
+            land->width = read16(data, &pos);
+            land->height = read16(data, &pos);
+            land->data = data + pos;
+            land->len = len - pos;
 
+            /* Only checked against the largest map, the receiver clips
+             * to its own. */
             if (land->x < 0 || land->y < 0 ||
-                land->x + land->width > LAND_WIDTH ||
-                land->y + land->height > LAND_HEIGHT)
+                land->width < 0 || land->height < 0 ||
+                land->x + land->width > MAX_LAND_WIDTH ||
+                land->y + land->height > MAX_LAND_HEIGHT)
             {
-                DIE("Bad PACKED_LAND_CHUNK.");
+                return false;
             }
 
-            if (pos == packet->dataLength)
-            {
-                DIE("Bad PACKED_LAND_CHUNK (Zero-length).\n");
-            }
-
-            memcpy(land->data, packet->data + pos, packet->dataLength - pos);
-
-            break;
+            if (chunk->type == LAND_CHUNK)
+                return land->len >= (size_t)land->width * land->height;
+            return land->len % 2 == 0;
         }
 
         case TANK_CHUNK:
         {
-            struct tank_chunk *tank = (void *)chunk;
+            struct tank_chunk *tank = &chunk->tank;
+
+            if (len < TANK_CHUNK_SIZE)
+                return false;
 
-            tank->action = read8(packet->data, &pos);
-            tank->id = read8(packet->data, &pos);
-            tank->x = read16(packet->data, &pos);
-            tank->y = read16(packet->data, &pos);
-            tank->angle = read8(packet->data, &pos);
+            tank->action = read8(data, &pos);
+            tank->id = read8(data, &pos);
+            tank->x = read16(data, &pos);
+            tank->y = read16(data, &pos);
+            tank->angle = read8(data, &pos);
 
-            break;
+            return is_action(tank->action) && tank->id < MAX_PLAYERS;
         }
 
         case BULLET_CHUNK:
         {
-            struct bullet_chunk *bullet = (void *)chunk;
-
-            bullet->action = read8(packet->data, &pos);
-            bullet->id = read8(packet->data, &pos);
-            bullet->x = read16(packet->data, &pos);
-            bullet->y = read16(packet->data, &pos);
-
-            break;
+            struct bullet_chunk *bullet = &chunk->bullet;
+
+            if (len < BULLET_CHUNK_SIZE)
+                return false;
+
+            bullet->action = read8(data, &pos);
+            bullet->id = read16(data, &pos);
+            bullet->type = read8(data, &pos);
+            bullet->seq = read16(data, &pos);
+            bullet->x = read_double(data, &pos);
+            bullet->y = read_double(data, &pos);
+            bullet->vx = read_double(data, &pos);
+            bullet->vy = read_double(data, &pos);
+
+            /* Bullets are flown from this, it must be a sane state. */
+            return is_action(bullet->action) && bullet->id < MAX_BULLETS &&
+                   bullet->type <= TRIPLER && bullet->seq != 0 &&
+                   WITHIN(-MAX_LAND_WIDTH, 2 * MAX_LAND_WIDTH, bullet->x) &&
+                   WITHIN(-MAX_LAND_HEIGHT, 2 * MAX_LAND_HEIGHT, bullet->y) &&
+                   WITHIN(-MAX_LAND_WIDTH, MAX_LAND_WIDTH, bullet->vx) &&
+                   WITHIN(-MAX_LAND_HEIGHT, MAX_LAND_HEIGHT, bullet->vy);
         }
 
         case CRATE_CHUNK:
         {
-            struct crate_chunk *crate = (void *)chunk;
+            struct crate_chunk *crate = &chunk->crate;
 
-            crate->action = read8(packet->data, &pos);
-            crate->x = read16(packet->data, &pos);
-            crate->y = read16(packet->data, &pos);
+            if (len < CRATE_CHUNK_SIZE)
+                return false;
 
-            break;
+            crate->action = read8(data, &pos);
+            crate->x = read16(data, &pos);
+            crate->y = read16(data, &pos);
+
+            return is_action(crate->action);
         }
 
         case SERVER_MSG_CHUNK:
         {
-            struct server_msg_chunk *server_msg = (void *)chunk;
-
-            server_msg->id = read8(packet->data, &pos);
-            server_msg->action = read8(packet->data, &pos);
-            memcpy(server_msg->data, packet->data + pos, packet->dataLength - pos);
+            struct server_msg_chunk *server_msg = &chunk->server_msg;
 
-            break;
-        }
+            if (len < SERVER_MSG_CHUNK_HEADER_SIZE)
+                return false;
 
-        default:
-            break;
-    }
+            server_msg->id = read8(data, &pos);
+            server_msg->action = read8(data, &pos);
+            server_msg->data = data + pos;
+            server_msg->len = len - pos;
 
-    return (void *)chunk;
-}
-
-void send_chunk(struct chunk_header *chunk, size_t len, bool broadcast, bool reliable)
-{
-    size_t pos = 0;
-    uint8_t buffer[len];
-
-    write8(buffer, &pos, chunk->type);
-
-    switch (chunk->type)
-    {
-        case INPUT_CHUNK:
-        {
-            struct input_chunk *input = (void *)chunk;
-
-            write8(buffer, &pos, input->key);
-            write16(buffer, &pos, input->ms);
-
-            break;
+            switch (server_msg->action)
+            {
+                case CHAT:
+                case NAME_CHANGE:
+                    return server_msg->id < MAX_PLAYERS;
+                case SERVER_NOTICE:
+                    return is_terminated(server_msg->data, server_msg->len);
+                default:
+                    return false;
+            }
         }
 
-        case CLIENT_MSG_CHUNK:
+        case WELCOME_CHUNK:
         {
-            struct client_msg_chunk *client_msg = (void *)chunk;
+            struct welcome_chunk *welcome = &chunk->welcome;
+
+            if (len < WELCOME_CHUNK_SIZE)
+                return false;
 
-            int end = len - pos;
-            for (int i = 0; i < end; ++i)
-                write8(buffer, &pos, client_msg->data[i]);
+            welcome->width = read16(data, &pos);
+            welcome->height = read16(data, &pos);
+            welcome->id = read8(data, &pos);
+            welcome->tick_ms = read8(data, &pos);
 
-            break;
+            return land_size_valid(welcome->width, welcome->height) &&
+                   welcome->id < MAX_PLAYERS && welcome->tick_ms > 0;
         }
 
-        case LAND_CHUNK:
+        case SNAPSHOT_CHUNK:
         {
-            struct land_chunk *land = (void *)chunk;
-
-            write16(buffer, &pos, land->x);
-            write16(buffer, &pos, land->y);
-            write16(buffer, &pos, land->width);
-            write16(buffer, &pos, land->height);
-
-            int end = len - pos;
-            for (int i = 0; i < end; ++i)
-                write8(buffer, &pos, land->data[i]);
-
-            break;
+            struct snapshot_chunk *snapshot = &chunk->snapshot;
+
+            if (len < SNAPSHOT_CHUNK_HEADER_SIZE)
+                return false;
+
+            snapshot->seq = read16(data, &pos);
+            snapshot->baseline = read16(data, &pos);
+            snapshot->tick = read16(data, &pos);
+            snapshot->input_seq = read16(data, &pos);
+            snapshot->input_ticks = read16(data, &pos);
+            snapshot->data = data + pos;
+            snapshot->len = len - pos;
+
+            /* Entries are checked as they're applied, they only make sense
+             * against the baseline. */
+            return snapshot->seq != 0;
         }
 
-        case PACKED_LAND_CHUNK:
+        case SNAPSHOT_ACK_CHUNK:
         {
-            struct packed_land_chunk *land = (void *)chunk;
+            struct snapshot_ack_chunk *ack = &chunk->snapshot_ack;
 
-            write16(buffer, &pos, land->x);
-            write16(buffer, &pos, land->y);
-            write16(buffer, &pos, land->width);
-            write16(buffer, &pos, land->height);
+            if (len < SNAPSHOT_ACK_CHUNK_SIZE)
+                return false;
 
-            int end = len - pos;
-            for (int i = 0; i < end; ++i)
-                write8(buffer, &pos, land->data[i]);
+            ack->seq = read16(data, &pos);
 
-            break;
+            return ack->seq != 0;
         }
 
-        case TANK_CHUNK:
+        case INPUT_BUNDLE_CHUNK:
         {
-            struct tank_chunk *tank = (void *)chunk;
+            struct input_bundle_chunk *bundle = &chunk->input_bundle;
 
-            write8(buffer, &pos, tank->action);
-            write8(buffer, &pos, tank->id);
-            write16(buffer, &pos, tank->x);
-            write16(buffer, &pos, tank->y);
-            write8(buffer, &pos, tank->angle);
+            if (len < INPUT_BUNDLE_CHUNK_HEADER_SIZE)
+                return false;
 
-            break;
-        }
+            bundle->frame = read32(data, &pos);
+            bundle->checksum = read32(data, &pos);
+            bundle->data = data + pos;
+            bundle->len = len - pos;
 
-        case BULLET_CHUNK:
-        {
-            struct bullet_chunk *bullet = (void *)chunk;
+            if (bundle->len % INPUT_BUNDLE_ENTRY_SIZE)
+                return false;
 
-            write8(buffer, &pos, bullet->action);
-            write8(buffer, &pos, bullet->id);
-            write16(buffer, &pos, bullet->x);
-            write16(buffer, &pos, bullet->y);
-
-            break;
+            size_t p = 0;
+            struct input_bundle_entry e;
+            while (p < bundle->len)
+            {
+                read_bundle_entry(bundle, &p, &e);
+                if (e.type > BUNDLE_LEAVE || e.id >= MAX_PLAYERS ||
+                    (e.type == BUNDLE_INPUT && e.key > KFIRE_RELEASED))
+                    return false;
+            }
+            return true;
         }
 
-        case CRATE_CHUNK:
+        case GAME_STATE_CHUNK:
         {
-            struct crate_chunk *crate = (void *)chunk;
-
-            write8(buffer, &pos, crate->action);
-            write16(buffer, &pos, crate->x);
-            write16(buffer, &pos, crate->y);
+            struct game_state_chunk *state = &chunk->game_state;
 
-            break;
+            /* Checked when it's read. */
+            state->data = data + pos;
+            state->len = len - pos;
+            return true;
         }
 
-        case SERVER_MSG_CHUNK:
-        {
-            struct server_msg_chunk *server_msg = (void *)chunk;
-
-            write8(buffer, &pos, server_msg->id);
-            write8(buffer, &pos, server_msg->action);
-
-            int end = len - pos;
-            for (int i = 0; i < end; ++i)
-                write8(buffer, &pos, server_msg->data[i]);
-
-            break;
-        }
+        case STATE_REQUEST_CHUNK:
+            return true;
 
         default:
-            break;
+            return false;
     }
-
-    send_packet(buffer, pos, broadcast, reliable);
 }
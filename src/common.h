@@ -13,9 +13,14 @@
 #include <time.h>
 #include <unistd.h>
 
-#include <enet/enet.h>
+#ifdef WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
 
 #include "moag.h"
+#include "land.h"
 
 #define SQ(x)           ((x) * (x))
 
@@ -43,38 +48,14 @@ void *safe_malloc(size_t len);
 void *safe_realloc(void *mem, size_t len);
 char *string_duplicate(const char *str);
 
+/* Microseconds since an arbitrary point, unaffected by changes to the wall
+ * clock. */
+uint64_t monotonic_us(void);
+
 /******************************************************************************\
-Networking.
+Serialization, in network byte order.
 \******************************************************************************/
 
-#define PORT            8080
-
-#define MAX_PLAYERS     MAX_CLIENTS
-#define CONNECT_TIMEOUT 10000
-#define MAX_CLIENTS     8
-#define NUM_CHANNELS    2
-
-void init_enet_client(const char *ip, unsigned port);
-void init_enet_server(unsigned port);
-void uninit_enet(void);
-
-ENetHost *get_client_host(void);
-ENetHost *get_server_host(void);
-ENetPeer *get_peer(void);
-
-static inline void send_packet(uint8_t *buf, size_t len, bool broadcast, bool reliable)
-{
-    uint32_t flags = 0;
-    if (reliable)
-        flags |= ENET_PACKET_FLAG_RELIABLE;
-    ENetPacket *packet = enet_packet_create(NULL, len, flags);
-    memcpy(packet->data, buf, len);
-    if (broadcast)
-        enet_host_broadcast(get_server_host(), 0, packet);
-    else
-        enet_peer_send(get_peer(), 1, packet);
-}
-
 static inline void write8(unsigned char *buf, size_t *pos, uint8_t val)
 {
     *(unsigned char *)(&buf[*pos]) = val;
@@ -93,27 +74,67 @@ static inline void write32(unsigned char *buf, size_t *pos, uint32_t val)
     (*pos) += 4;
 }
 
-static inline uint8_t read8(unsigned char *buf, size_t *pos)
+/* Doubles are sent as their IEEE 754 bits, so both ends compute with exactly
+ * the same values. */
+static inline void write_double(unsigned char *buf, size_t *pos, double val)
+{
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof bits);
+    write32(buf, pos, bits >> 32);
+    write32(buf, pos, bits & 0xffffffff);
+}
+
+static inline void write_float(unsigned char *buf, size_t *pos, float val)
 {
-    uint8_t val = *(char *)(&buf[*pos]);
+    uint32_t bits;
+    memcpy(&bits, &val, sizeof bits);
+    write32(buf, pos, bits);
+}
+
+static inline void write_bytes(unsigned char *buf, size_t *pos, const void *src, size_t len)
+{
+    memcpy(&buf[*pos], src, len);
+    (*pos) += len;
+}
+
+static inline uint8_t read8(const unsigned char *buf, size_t *pos)
+{
+    uint8_t val = *(const char *)(&buf[*pos]);
     (*pos) += 1;
     return val;
 }
 
-static inline uint16_t read16(unsigned char *buf, size_t *pos)
+static inline uint16_t read16(const unsigned char *buf, size_t *pos)
 {
-    uint16_t val = ntohs(*(uint16_t *)(&buf[*pos]));
+    uint16_t val = ntohs(*(const uint16_t *)(&buf[*pos]));
     (*pos) += 2;
     return val;
 }
 
-static inline uint32_t read32(unsigned char *buf, size_t *pos)
+static inline uint32_t read32(const unsigned char *buf, size_t *pos)
 {
-    uint32_t val = ntohl(*(uint32_t *)(&buf[*pos]));
+    uint32_t val = ntohl(*(const uint32_t *)(&buf[*pos]));
     (*pos) += 4;
     return val;
 }
 
+static inline double read_double(const unsigned char *buf, size_t *pos)
+{
+    uint64_t bits = (uint64_t)read32(buf, pos) << 32;
+    bits |= read32(buf, pos);
+    double val;
+    memcpy(&val, &bits, sizeof val);
+    return val;
+}
+
+static inline float read_float(const unsigned char *buf, size_t *pos)
+{
+    uint32_t bits = read32(buf, pos);
+    float val;
+    memcpy(&val, &bits, sizeof val);
+    return val;
+}
+
 /******************************************************************************\
 Physics.
 \******************************************************************************/
@@ -270,12 +291,30 @@ static inline bool line_overlaps_rect(struct rect r, struct line l)
 Shared structures.
 \******************************************************************************/
 
-#define INPUT_CHUNK_SIZE        4
 #define CLIENT_MSG_CHUNK_SIZE   258
 #define TANK_CHUNK_SIZE         8
-#define BULLET_CHUNK_SIZE       7
+#define BULLET_CHUNK_SIZE       39
 #define CRATE_CHUNK_SIZE        6
 #define SERVER_MSG_CHUNK_SIZE   260
+#define WELCOME_CHUNK_SIZE      7
+
+#define SNAPSHOT_ACK_CHUNK_SIZE 3
+#define STATE_REQUEST_CHUNK_SIZE 1
+
+/* Fixed part of a SNAPSHOT_CHUNK, and the most one of its entries takes. */
+#define SNAPSHOT_CHUNK_HEADER_SIZE  11
+#define SNAPSHOT_ENTRY_MAX_SIZE     8
+
+/* Fixed part of the variable length chunks. */
+#define LAND_CHUNK_HEADER_SIZE          9
+#define INPUT_CHUNK_HEADER_SIZE         3
+#define INPUT_ENTRY_SIZE                3
+#define MAX_INPUTS_PER_CHUNK            16
+#define INPUT_BUNDLE_CHUNK_HEADER_SIZE  9
+#define INPUT_BUNDLE_ENTRY_SIZE         5
+#define GAME_STATE_CHUNK_HEADER_SIZE    1
+#define CLIENT_MSG_CHUNK_HEADER_SIZE    1
+#define SERVER_MSG_CHUNK_HEADER_SIZE    3
 
 /* Chunk types. */
 enum
@@ -284,10 +323,14 @@ enum
      * Client -> Server
      */
 
-    /* RELIABLE
+    /* UNRELIABLE, every input the server hasn't applied yet, at most
+     * MAX_INPUTS_PER_CHUNK of them. Sent again each tick until they're
+     * acknowledged, and applied by the server once each by sequence number.
      * 1: INPUT_CHUNK
-     * 1: *_*_CHUNK
-     * 2: Milliseconds held.
+     * 2: sequence number of the first input, the rest follow on from it
+     * REPEATED, oldest first
+     *  1: K*_PRESSED/K*_RELEASED
+     *  2: milliseconds held
      */
     INPUT_CHUNK,
 
@@ -307,7 +350,7 @@ enum
      * 2: y-position
      * 2: width
      * 2: height
-     * X: zipped land (columns first)
+     * X: 1 byte per cell, rows first
      */
     LAND_CHUNK,
     /* RELIABLE
@@ -316,8 +359,7 @@ enum
      * 2: y-position
      * 2: width
      * 2: height
-     * 4: packed-size
-     * X: RLE-compressed data
+     * X: RLE-compressed data to the end of the packet, see pack_land()
      */
     PACKED_LAND_CHUNK,
     /* VARIES
@@ -330,13 +372,17 @@ enum
      *  1: angle (0 to 180), 0 is left, 180 is right
      */
     TANK_CHUNK,
-    /* VARIES
+    /* RELIABLE, clients fly bullets themselves so this is only sent when one
+     * is fired, killed, or moved by anything but its flight (MOVE).
      * 1: BULLET_CHUNK
      * 1: SPAWN/KILL/MOVE
-     * 1: id
-     * IF NOT KILL
-     *  2: x-position
-     *  2: y-position
+     * 2: id
+     * 1: type
+     * 2: sequence number of the snapshot the state is for
+     * 8: x-position, double
+     * 8: y-position, double
+     * 8: x-velocity, double
+     * 8: y-velocity, double
      */
     BULLET_CHUNK,
     /* VARIES
@@ -354,6 +400,94 @@ enum
      * length: characters
      */
     SERVER_MSG_CHUNK,
+    /* RELIABLE, sent first to a client that joins
+     * 1: WELCOME_CHUNK
+     * 2: map width
+     * 2: map height
+     * 1: id of the client's player
+     * 1: milliseconds per tick
+     */
+    WELCOME_CHUNK,
+    /* UNRELIABLE, the state of every entity, sent every few ticks as changes
+     * from the last snapshot the client acknowledged. One is taken every
+     * tick, so sequence numbers count ticks.
+     * 1: SNAPSHOT_CHUNK
+     * 2: sequence number
+     * 2: sequence number of the baseline, 0 if changed from nothing
+     * 2: frame it was taken at, wrapping around
+     * 2: sequence number of the client's newest input applied, 0 for none
+     * 2: ticks stepped since it was applied, at most 65535
+     * REPEATED for each entity that differs from the baseline
+     *  1: TANK_CHUNK/CRATE_CHUNK
+     *  1: id
+     *  1: changed fields, SNAP_*
+     *  1 or 2: x-position, a change if 1 byte
+     *  1 or 2: y-position, a change if 1 byte
+     *  1: angle, tanks only
+     */
+    SNAPSHOT_CHUNK,
+
+    /******************
+     * Client -> Server
+     */
+
+    /* UNRELIABLE
+     * 1: SNAPSHOT_ACK_CHUNK
+     * 2: sequence number of the newest snapshot received
+     */
+    SNAPSHOT_ACK_CHUNK,
+
+    /******************
+     * Server -> Client, lockstep servers only. Clients step the game
+     * themselves and are sent nothing else about it.
+     */
+
+    /* RELIABLE, everything that happened to the game before a frame, in the
+     * order the server applied it.
+     * 1: INPUT_BUNDLE_CHUNK
+     * 4: frame
+     * 4: checksum of the game once the entries are applied, 0 if not sent
+     * REPEATED
+     *  1: BUNDLE_INPUT/BUNDLE_JOIN/BUNDLE_LEAVE
+     *  1: player id
+     *  1: key, inputs only
+     *  2: milliseconds held, inputs only
+     */
+    INPUT_BUNDLE_CHUNK,
+    /* RELIABLE, sent when a client joins or asks for it
+     * 1: GAME_STATE_CHUNK
+     * X: the game, see write_game_state()
+     */
+    GAME_STATE_CHUNK,
+
+    /******************
+     * Client -> Server
+     */
+
+    /* RELIABLE, sent by a lockstep client whose game went out of sync
+     * 1: STATE_REQUEST_CHUNK
+     */
+    STATE_REQUEST_CHUNK,
+};
+
+/* Input bundle entries. */
+enum
+{
+    BUNDLE_INPUT,
+    BUNDLE_JOIN,
+    BUNDLE_LEAVE,
+};
+
+/* Changed fields of a snapshot entry. An entry without SNAP_GONE means the
+ * entity exists. */
+enum
+{
+    SNAP_X8     = 1 << 0,
+    SNAP_X16    = 1 << 1,
+    SNAP_Y8     = 1 << 2,
+    SNAP_Y16    = 1 << 3,
+    SNAP_ANGLE  = 1 << 4,
+    SNAP_GONE   = 1 << 5,
 };
 
 /* Input types.
@@ -386,56 +520,49 @@ enum
     NAME_CHANGE,
 };
 
-/* The following structs must be tightly packed
- * because they're used to read packet data. */
-#ifdef _MSC_VER
-#  define PACKED_STRUCT(name) \
-    __pragma(pack(push, 1)) struct name __pragma(pack(pop))
-#elif defined(__GNUC__)
-#  define PACKED_STRUCT(name) struct __attribute__((packed)) name
-#endif
-
-PACKED_STRUCT(chunk_header)
+/* Decoded chunks. Variable length data points into the packet it was received
+ * in and is only valid as long as the packet is.
+ */
+struct input_chunk
 {
-    uint8_t type;
+    uint16_t seq;
+    const uint8_t *data;
+    size_t len;
 };
 
-PACKED_STRUCT(input_chunk)
+struct input_entry
 {
-    struct chunk_header _;
     uint8_t key;
     uint16_t ms;
 };
 
-PACKED_STRUCT(client_msg_chunk)
+/* Reads the entry at *pos, the chunk must have been received. */
+static inline void read_input_entry(const struct input_chunk *input, size_t *pos,
+                                    struct input_entry *e)
 {
-    struct chunk_header _;
-    uint8_t data[];
-};
+    e->key = read8(input->data, pos);
+    e->ms = read16(input->data, pos);
+}
 
-PACKED_STRUCT(land_chunk)
+struct client_msg_chunk
 {
-    struct chunk_header _;
-    int16_t x;
-    int16_t y;
-    int16_t width;
-    int16_t height;
-    uint8_t data[];
+    const uint8_t *data;
+    size_t len;
 };
 
-PACKED_STRUCT(packed_land_chunk)
+/* LAND_CHUNK and PACKED_LAND_CHUNK. */
+struct land_chunk
 {
-    struct chunk_header _;
     int16_t x;
     int16_t y;
     int16_t width;
     int16_t height;
-    uint8_t data[];
+    const uint8_t *data;
+    size_t len;
 };
 
-PACKED_STRUCT(tank_chunk)
+struct tank_chunk
 {
-    struct chunk_header _;
     uint8_t action;
     uint8_t id;
     uint16_t x;
@@ -443,43 +570,165 @@ PACKED_STRUCT(tank_chunk)
     uint8_t angle;
 };
 
-PACKED_STRUCT(bullet_chunk)
+struct bullet_chunk
 {
-    struct chunk_header _;
     uint8_t action;
-    uint8_t id;
-    uint16_t x;
-    uint16_t y;
+    uint16_t id;
+    uint8_t type;
+    uint16_t seq;
+    double x, y;
+    double vx, vy;
 };
 
-PACKED_STRUCT(crate_chunk)
+struct crate_chunk
 {
-    struct chunk_header _;
     uint8_t action;
     uint16_t x;
     uint16_t y;
 };
 
-PACKED_STRUCT(server_msg_chunk)
+struct server_msg_chunk
 {
-    struct chunk_header _;
     uint8_t id;
     uint8_t action;
-    uint8_t data[];
+    const uint8_t *data;
+    size_t len;
+};
+
+struct welcome_chunk
+{
+    uint16_t width;
+    uint16_t height;
+    uint8_t id;
+    uint8_t tick_ms;
+};
+
+/* Entries are applied to the baseline by read_snapshot(). */
+struct snapshot_chunk
+{
+    uint16_t seq;
+    uint16_t baseline;
+    uint16_t tick;
+    uint16_t input_seq;
+    uint16_t input_ticks;
+    const uint8_t *data;
+    size_t len;
 };
 
-struct chunk_header *receive_chunk(ENetPacket *packet);
-void send_chunk(struct chunk_header *chunk, size_t len, bool broadcast, bool reliable);
+struct snapshot_ack_chunk
+{
+    uint16_t seq;
+};
+
+struct input_bundle_chunk
+{
+    uint32_t frame;
+    uint32_t checksum;
+    const uint8_t *data;
+    size_t len;
+};
+
+struct input_bundle_entry
+{
+    uint8_t type;
+    uint8_t id;
+    uint8_t key;
+    uint16_t ms;
+};
+
+/* Reads the entry at *pos, the bundle must have been received. */
+static inline void read_bundle_entry(const struct input_bundle_chunk *bundle, size_t *pos,
+                                     struct input_bundle_entry *e)
+{
+    e->type = read8(bundle->data, pos);
+    e->id = read8(bundle->data, pos);
+    e->key = read8(bundle->data, pos);
+    e->ms = read16(bundle->data, pos);
+}
+
+struct game_state_chunk
+{
+    const uint8_t *data;
+    size_t len;
+};
+
+/* The field matching type is filled in by receive_chunk(). */
+struct chunk
+{
+    uint8_t type;
+    struct input_chunk input;
+    struct client_msg_chunk client_msg;
+    struct land_chunk land;
+    struct tank_chunk tank;
+    struct bullet_chunk bullet;
+    struct crate_chunk crate;
+    struct server_msg_chunk server_msg;
+    struct welcome_chunk welcome;
+    struct snapshot_chunk snapshot;
+    struct snapshot_ack_chunk snapshot_ack;
+    struct input_bundle_chunk input_bundle;
+    struct game_state_chunk game_state;
+};
+
+/* Decodes a chunk without copying or allocating, variable length data points
+ * into data. Returns false for unknown, short or out of range chunks, which
+ * should be dropped.
+ */
+bool decode_chunk(const uint8_t *data, size_t len, struct chunk *chunk);
+
+/* A replay is everything that made a game, as the chunks that carried it:
+ * HEADER
+ *  4: REPLAY_MAGIC
+ *  1: REPLAY_VERSION
+ *  1: milliseconds per tick
+ * REPEATED
+ *  4: frame the chunk was applied before
+ *  4: length of the chunk
+ *  X: GAME_STATE_CHUNK, the first record only
+ *     INPUT_BUNDLE_CHUNK
+ *     SERVER_MSG_CHUNK, NAME_CHANGE only
+ * Frames without inputs or a checksum aren't recorded.
+ */
+#define REPLAY_MAGIC                "MOAG"
+#define REPLAY_VERSION              2
+#define REPLAY_HEADER_SIZE          6
+#define REPLAY_RECORD_HEADER_SIZE   8
+
 
 /******************************************************************************\
 \******************************************************************************/
 
-#define MAX_BULLETS     64
-#define MAX_TIMERS      64
+#define MAX_CLIENTS     8
+#define MAX_PLAYERS     MAX_CLIENTS
+#define MAX_BULLETS     4096
+#define MAX_TIMERS      4096
 #define MAX_NAME_LEN    16
+#define MAX_DIRTY_RECTS 16
+#define SNAPSHOT_HISTORY 64
 
-#define LAND_WIDTH      800
-#define LAND_HEIGHT     600
+#define GRAVITY         0.1
+
+/* Bullet types. */
+enum
+{
+    MISSILE,
+    BABY_NUKE,
+    NUKE,
+    DIRT,
+    SUPER_DIRT,
+    COLLAPSE,
+    LIQUID_DIRT,
+    BOUNCER,
+    TUNNELER,
+    LADDER,
+    MIRV,
+    MIRV_WARHEAD,
+    CLUSTER_BOMB,
+    CLUSTER_BOUNCER,
+    SHOTGUN,
+    LIQUID_DIRT_WARHEAD,
+    TRIPLER,
+};
 
 /* WIP. Object is effected by physics. */
 struct object
@@ -507,6 +756,16 @@ struct bullet
     char type;
 };
 
+/* One tick of a bullet's flight, which the server and clients both do. */
+static inline void bullet_fly(struct bullet *b)
+{
+    b->obj.pos = VEC2_ADD(b->obj.pos, b->obj.vel);
+    if (b->type != LADDER)
+        b->obj.vel = VEC2_ADD(b->obj.vel, VEC2(0, GRAVITY));
+    b->x = (int)b->obj.pos.x;
+    b->y = (int)b->obj.pos.y;
+}
+
 struct crate
 {
     struct object obj;
@@ -534,29 +793,130 @@ struct timer
     float x, y, vx, vy;
 };
 
+/* The part of an entity snapshots carry. Absent entities are all zero. */
+struct entity_state
+{
+    bool present;
+    uint16_t x, y;
+    int8_t angle;
+};
+
+/* Snapshots are kept by both ends, the last SNAPSHOT_HISTORY of them by
+ * seq % SNAPSHOT_HISTORY, so changes can be sent against any that's been
+ * acknowledged.
+ */
+struct snapshot_state
+{
+    uint16_t seq;
+    uint16_t tick;
+    struct entity_state tanks[MAX_PLAYERS];
+    struct entity_state crate;
+};
+
+/* Newer than, for sequence numbers that wrap around. */
+static inline bool seq_after(uint16_t a, uint16_t b)
+{
+    return (int16_t)(a - b) > 0;
+}
+
+/* Sequence numbers skip 0, which means none. */
+static inline uint16_t next_seq(uint16_t seq)
+{
+    return seq == UINT16_MAX ? 1 : seq + 1;
+}
+
+/* Applies a snapshot to its baseline, base is NULL for one changed from
+ * nothing. Returns false if the snapshot is malformed.
+ */
+bool read_snapshot(const struct snapshot_chunk *snapshot,
+                   const struct snapshot_state *base, struct snapshot_state *out);
+
+enum
+{
+    JOB_CARVE,
+    JOB_COLLAPSE,
+    JOB_POUR
+};
+
+/* Terrain work that may be too big for one tick, done a slice at a time.
+ * next is the row (carving) or column (collapsing) to do next, relative to
+ * x, y. Only the oldest job runs, so a single pour state is kept in moag.
+ */
+struct terrain_job
+{
+    char type;
+    int x, y, rad;
+    bool solid;
+    int next;
+    int amount;
+    bool started;
+};
+
+/* Things that happen in the game which whoever runs it passes on. */
+enum
+{
+    EVENT_TANK_SPAWNED,
+    EVENT_TANK_KILLED,
+    /* A bullet was fired, or moved by anything but its flight. */
+    EVENT_BULLET_CHANGED,
+    EVENT_BULLET_KILLED,
+    EVENT_CRATE_SPAWNED,
+    EVENT_CRATE_TAKEN,
+    EVENT_NOTICE
+};
+
+#define MAX_NOTICE_LEN  64
+
+struct game_event
+{
+    int type;
+    /* The tank or bullet, for events that have one. */
+    int id;
+    char notice[MAX_NOTICE_LEN];
+};
+
 struct moag
 {
     struct player players[MAX_PLAYERS];
     struct bullet bullets[MAX_BULLETS];
     struct timer timers[MAX_TIMERS];
+
+    /* Ids of the bullets and timers in use, in the order they're updated, and
+     * the ids free for the next ones, taken from the end. */
+    uint16_t live_bullets[MAX_BULLETS], free_bullets[MAX_BULLETS];
+    int num_bullets, num_free_bullets;
+    uint16_t live_timers[MAX_TIMERS], free_timers[MAX_TIMERS];
+    int num_timers, num_free_timers;
     struct crate crate;
-    char land[LAND_WIDTH * LAND_HEIGHT];
+    struct land land;
     struct rng_state rng;
     int frame;
+
+    /* Land modified this tick, flushed to clients at the end of the tick.
+     * Overlapping rectangles are merged as they're added. */
+    struct land_rect dirty[MAX_DIRTY_RECTS];
+    int num_dirty;
+
+    /* Events in the order they happened, kept until they're passed on. */
+    struct game_event *events;
+    int num_events, max_events;
+
+    /* Terrain jobs in the order they're run, for up to terrain_budget_us a
+     * tick or as they're queued if it's 0. A ring that grows when it's full. */
+    struct terrain_job *jobs;
+    int first_job, num_jobs, max_jobs;
+    struct land_pour pour;
+    uint64_t terrain_budget_us;
 };
 
 static inline char get_land_at(struct moag *m, int x, int y)
 {
-    if (x < 0 || x >= LAND_WIDTH || y < 0 || y >= LAND_HEIGHT)
-        return -1;
-    return m->land[y * LAND_WIDTH + x];
+    return land_get(&m->land, x, y);
 }
 
 static inline void set_land_at(struct moag *m, int x, int y, char to)
 {
-    if (x < 0 || x >= LAND_WIDTH || y < 0 || y >= LAND_HEIGHT)
-        return;
-    m->land[y * LAND_WIDTH + x] = to;
+    land_set(&m->land, x, y, to);
 }
 
 #endif
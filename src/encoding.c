@@ -6,6 +6,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "moag.h"
+
 /* run length encoding
  * format: [byte data] [byte repetitions-1] repeat
  */
@@ -72,3 +74,29 @@ uint8_t *rldecode(const uint8_t *src, size_t len, size_t *outlen) {
 
 	return buf;
 }
+
+/* streaming run length encoding, same format as rlencode()
+ */
+void rlencode_begin(struct rlencoder *enc, uint8_t *dst) {
+	enc->dst = dst;
+	enc->pos = 0;
+	enc->c = 0;
+	enc->run = 0;
+}
+
+void rlencode_flush(struct rlencoder *enc) {
+	while (enc->run > 0) {
+		size_t n = enc->run > 256 ? 256 : enc->run;
+		if (enc->dst) {
+			enc->dst[enc->pos] = enc->c;
+			enc->dst[enc->pos+1] = (uint8_t)(n-1);
+		}
+		enc->pos += 2;
+		enc->run -= n;
+	}
+}
+
+size_t rlencode_end(struct rlencoder *enc) {
+	rlencode_flush(enc);
+	return enc->pos;
+}
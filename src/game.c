@@ -0,0 +1,1371 @@
+#include "game.h"
+
+static struct game_event *add_event(struct moag *m, int type, int id)
+{
+    if (m->num_events >= m->max_events)
+    {
+        m->max_events = m->max_events ? m->max_events * 2 : 16;
+        m->events = safe_realloc(m->events, m->max_events * sizeof *m->events);
+    }
+    struct game_event *ev = &m->events[m->num_events++];
+    ev->type = type;
+    ev->id = id;
+    ev->notice[0] = '\0';
+    return ev;
+}
+
+void clear_game_events(struct moag *m)
+{
+    m->num_events = 0;
+}
+
+/* Bullets and timers are kept in slots. Free slots are taken from the top of
+ * a stack of their ids, and slots in use are listed in the order they were
+ * taken, which is the order they're updated in.
+ */
+static void reset_slots(uint16_t *free_ids, int *num_free, int *num_live, int max)
+{
+    for (int i = 0; i < max; i++)
+        free_ids[i] = max - 1 - i;
+    *num_free = max;
+    *num_live = 0;
+}
+
+/* Returns the id of a free slot and lists it, or -1 if there are none. */
+static int take_slot(uint16_t *live, int *num_live, uint16_t *free_ids, int *num_free)
+{
+    if (!*num_free)
+        return -1;
+    int id = free_ids[--*num_free];
+    live[(*num_live)++] = id;
+    return id;
+}
+
+void set_timer(struct moag *m, int frame, char type, float x, float y, float vx, float vy)
+{
+    int i = take_slot(m->live_timers, &m->num_timers, m->free_timers, &m->num_free_timers);
+    if (i < 0)
+        return;
+    m->timers[i].frame = frame;
+    m->timers[i].type = type;
+    m->timers[i].x = x;
+    m->timers[i].y = y;
+    m->timers[i].vx = vx;
+    m->timers[i].vy = vy;
+}
+
+static bool land_rects_touch(struct land_rect *a, struct land_rect *b)
+{
+    return a->x <= b->x + b->w && b->x <= a->x + a->w &&
+           a->y <= b->y + b->h && b->y <= a->y + a->h;
+}
+
+static struct land_rect land_rect_union(struct land_rect *a, struct land_rect *b)
+{
+    struct land_rect r;
+    r.x = MIN(a->x, b->x);
+    r.y = MIN(a->y, b->y);
+    r.w = MAX(a->x + a->w, b->x + b->w) - r.x;
+    r.h = MAX(a->y + a->h, b->y + b->h) - r.y;
+    return r;
+}
+
+/* Records that a rectangle of land changed this tick. Rectangles that touch
+ * are merged so a tick of overlapping explosions is flushed as one update.
+ */
+void mark_land_dirty(struct moag *m, int x, int y, int w, int h)
+{
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    if (x + w > m->land.width) w = m->land.width - x;
+    if (y + h > m->land.height) h = m->land.height - y;
+    if (w <= 0 || h <= 0)
+        return;
+
+    struct land_rect r = {x, y, w, h};
+
+    for (;;)
+    {
+        int i;
+        for (i = 0; i < m->num_dirty; i++)
+            if (land_rects_touch(&r, &m->dirty[i]))
+                break;
+
+        if (i == m->num_dirty)
+        {
+            if (m->num_dirty < MAX_DIRTY_RECTS)
+                break;
+
+            /* Out of room, grow whichever rectangle grows the least. */
+            int best = 0;
+            int best_growth = -1;
+            for (int j = 0; j < m->num_dirty; j++)
+            {
+                struct land_rect u = land_rect_union(&r, &m->dirty[j]);
+                int growth = u.w * u.h - m->dirty[j].w * m->dirty[j].h;
+                if (best_growth < 0 || growth < best_growth)
+                {
+                    best = j;
+                    best_growth = growth;
+                }
+            }
+            i = best;
+        }
+
+        r = land_rect_union(&r, &m->dirty[i]);
+        m->dirty[i] = m->dirty[--m->num_dirty];
+    }
+
+    m->dirty[m->num_dirty++] = r;
+}
+
+/* Largest h with SQ(h) + SQ(d) < SQ(rad), the half width of a circle's span
+ * d rows (or columns) from its center. -1 if the circle doesn't reach.
+ */
+static int circle_half_width(int rad, int d)
+{
+    int n = SQ(rad) - SQ(d) - 1;
+    if (n < 0)
+        return -1;
+    int h = (int)sqrt((double)n);
+    while (SQ(h + 1) <= n)
+        h++;
+    while (SQ(h) > n)
+        h--;
+    return h;
+}
+
+void kill_tank(struct moag *m, int id)
+{
+    m->players[id].tank.x = -30;
+    m->players[id].tank.y = -30;
+    m->players[id].spawn_timer = RESPAWN_TIME;
+    add_event(m, EVENT_TANK_KILLED, id);
+}
+
+/* Does one slice of the oldest terrain job, removing it once it's done. */
+static void terrain_job_slice(struct moag *m)
+{
+    struct terrain_job *job = &m->jobs[m->first_job];
+    bool done = false;
+
+    switch (job->type)
+    {
+        case JOB_CARVE:
+        {
+            const int top = job->next;
+            for (int i = 0; i < CARVE_ROWS_PER_SLICE && !done; i++)
+            {
+                int hw = circle_half_width(job->rad, job->next);
+                if (hw >= 0)
+                    land_fill_span(&m->land, job->x - hw, job->x + hw + 1,
+                                   job->y + job->next, job->solid);
+                job->next++;
+                done = job->next > job->rad || job->y + job->next >= m->land.height;
+            }
+            mark_land_dirty(m, job->x - job->rad, job->y + top,
+                            job->rad * 2, job->next - top);
+            break;
+        }
+
+        case JOB_COLLAPSE:
+        {
+            /* Everything solid in the circle falls. Each column is settled on
+             * its own, only tracking the cells that actually changed. */
+            int minx = m->land.width, miny = m->land.height;
+            int maxx = -1, maxy = -1;
+            for (int i = 0; i < COLLAPSE_COLUMNS_PER_SLICE && !done; i++)
+            {
+                int ix = job->x + job->next;
+                int hh = circle_half_width(job->rad, job->next);
+                int top, bot;
+                if (hh >= 0 &&
+                    land_settle_column(&m->land, ix, job->y - hh, job->y + hh, &top, &bot))
+                {
+                    minx = MIN(minx, ix);
+                    maxx = MAX(maxx, ix);
+                    miny = MIN(miny, top);
+                    maxy = MAX(maxy, bot);
+                }
+                job->next++;
+                done = job->next > job->rad;
+            }
+            if (maxx >= 0)
+                mark_land_dirty(m, minx, miny, maxx - minx + 1, maxy - miny + 1);
+            break;
+        }
+
+        case JOB_POUR:
+        {
+            struct land_rect filled;
+            if (!job->started)
+            {
+                land_pour_begin(&m->pour, &m->land, job->x, job->y, job->amount);
+                job->started = true;
+            }
+            done = land_pour_step(&m->pour, &m->land, POUR_CELLS_PER_SLICE, &filled);
+            mark_land_dirty(m, filled.x, filled.y, filled.w, filled.h);
+            if (done)
+                land_pour_end(&m->pour);
+            break;
+        }
+
+        default:
+            done = true;
+            break;
+    }
+
+    if (done)
+    {
+        m->first_job = (m->first_job + 1) % m->max_jobs;
+        m->num_jobs--;
+    }
+}
+
+/* Runs terrain jobs for up to budget_us microseconds, or until there are none
+ * left if budget_us is 0. At least one slice is run if there's anything to do,
+ * so big jobs always finish eventually. Returns the number of slices run.
+ */
+int run_terrain_jobs(struct moag *m, uint64_t budget_us)
+{
+    const uint64_t start = monotonic_us();
+    int slices = 0;
+    while (m->num_jobs)
+    {
+        terrain_job_slice(m);
+        slices++;
+        if (budget_us && monotonic_us() - start >= budget_us)
+            break;
+    }
+    return slices;
+}
+
+static void queue_terrain_job(struct moag *m, char type, int x, int y, int rad,
+                              bool solid, int amount)
+{
+    if (m->num_jobs == m->max_jobs)
+    {
+        int old_max = m->max_jobs;
+        m->max_jobs = old_max ? old_max * 2 : 32;
+        m->jobs = safe_realloc(m->jobs, m->max_jobs * sizeof *m->jobs);
+        /* Jobs that had wrapped around to the start go after the rest. */
+        if (m->first_job + m->num_jobs > old_max)
+            memcpy(&m->jobs[old_max], m->jobs,
+                   (m->first_job + m->num_jobs - old_max) * sizeof *m->jobs);
+    }
+
+    struct terrain_job *job = &m->jobs[(m->first_job + m->num_jobs++) % m->max_jobs];
+    job->type = type;
+    job->x = x;
+    job->y = y;
+    job->rad = rad;
+    job->solid = solid;
+    job->next = type == JOB_CARVE ? MAX(-rad, -y) : -rad;
+    job->amount = amount;
+    job->started = false;
+
+    if (!m->terrain_budget_us)
+        run_terrain_jobs(m, 0);
+}
+
+/* Tanks caught in an explosion die right away, the land it carves is queued
+ * and shows up within the next few ticks.
+ */
+void explode(struct moag *m, int x, int y, int rad, char type)
+{
+    if (type == E_EXPLODE)
+        for (int i = 0; i < MAX_PLAYERS; i++)
+            if (m->players[i].connected &&
+                SQ(m->players[i].tank.x - x) + SQ(m->players[i].tank.y - 3 - y) < SQ(rad + 4))
+                kill_tank(m, i);
+
+    if (type == E_COLLAPSE)
+        queue_terrain_job(m, JOB_COLLAPSE, x, y, rad, false, 0);
+    else
+        queue_terrain_job(m, JOB_CARVE, x, y, rad, type == E_DIRT, 0);
+}
+
+void spawn_tank(struct moag *m, int id)
+{
+    m->players[id].connected = true;
+    m->players[id].spawn_timer = 0;
+    m->players[id].ladder_timer = LADDER_TIME;
+    m->players[id].ladder_count = 3;
+    m->players[id].kleft = false;
+    m->players[id].kright = false;
+    m->players[id].kup = false;
+    m->players[id].kdown = false;
+    m->players[id].kfire = false;
+    m->players[id].tank.x = rng_range(&m->rng, 20, m->land.width - 20);
+    m->players[id].tank.y = 60;
+    m->players[id].tank.obj.pos = VEC2(m->players[id].tank.x, m->players[id].tank.y);
+    m->players[id].tank.obj.vel = VEC2(0, 0);
+    m->players[id].tank.angle = 35;
+    m->players[id].tank.facingleft = 0;
+    m->players[id].tank.power = 0;
+    m->players[id].tank.bullet = MISSILE;
+    m->players[id].tank.num_burst = 1;
+    explode(m, m->players[id].tank.x, m->players[id].tank.y - 12, 12, E_SAFE_EXPLODE);
+    add_event(m, EVENT_TANK_SPAWNED, id);
+}
+
+void launch_ladder(struct moag *m, int x, int y)
+{
+    int i = take_slot(m->live_bullets, &m->num_bullets, m->free_bullets, &m->num_free_bullets);
+    if (i < 0)
+        return;
+    m->bullets[i].active = LADDER_LENGTH;
+    m->bullets[i].type = LADDER;
+    m->bullets[i].x = x;
+    m->bullets[i].y = y;
+    m->bullets[i].obj.pos = VEC2(x, y);
+    m->bullets[i].obj.vel = VEC2(0, -1);
+    add_event(m, EVENT_BULLET_CHANGED, i);
+}
+
+void fire_bullet(struct moag *m, char type, float x, float y, float vx, float vy)
+{
+    int i = take_slot(m->live_bullets, &m->num_bullets, m->free_bullets, &m->num_free_bullets);
+    if (i < 0)
+        return;
+    m->bullets[i].active = 4;
+    m->bullets[i].type = type;
+    m->bullets[i].obj.pos = VEC2(x, y);
+    m->bullets[i].x = (int)m->bullets[i].obj.pos.x;
+    m->bullets[i].y = (int)m->bullets[i].obj.pos.y;
+    m->bullets[i].obj.vel = VEC2(vx, vy);
+    add_event(m, EVENT_BULLET_CHANGED, i);
+}
+
+void fire_bullet_ang(struct moag *m, char type, int x, int y, float angle, float vel)
+{
+    fire_bullet(m, type, (float)x + 5.0 * cosf(DEG2RAD(angle)),
+                         (float)y - 5.0 * sinf(DEG2RAD(angle)),
+                         vel * cosf(DEG2RAD(angle)),
+                        -vel * sinf(DEG2RAD(angle)));
+}
+
+void liquid(struct moag *m, int x, int y, int n)
+{
+    queue_terrain_job(m, JOB_POUR, x, y, 0, true, n);
+}
+
+/* Moves, climbs, falls and aims the tank by the keys held, which clients also
+ * do for their own tank so it moves before the server says so. Nothing but the
+ * tank is changed, and only the land is looked at.
+ */
+void tank_move(struct moag *m, int id)
+{
+    struct tank *t = &m->players[id].tank;
+
+    bool grav = true;
+    if (m->players[id].kleft && !m->players[id].kright)
+    {
+        t->facingleft = 1;
+        if (get_land_at(m, t->x - 1, t->y) == 0 && t->x >= 10)
+        {
+            t->x--;
+        }
+        else if (get_land_at(m, t->x - 1, t->y - 1) == 0 && t->x >= 10)
+        {
+            t->x--;
+            t->y--;
+        }
+        else if (get_land_at(m, t->x, t->y - 1) == 0 ||
+                 get_land_at(m, t->x, t->y - 2) == 0 ||
+                 get_land_at(m, t->x, t->y - 3) == 0)
+        {
+            grav = false;
+            t->y--;
+        }
+        else
+        {
+            grav = false;
+        }
+    }
+    else if (m->players[id].kright && !m->players[id].kleft)
+    {
+        t->facingleft = 0;
+        if (get_land_at(m, t->x + 1, t->y) == 0 && t->x < m->land.width - 10)
+        {
+            t->x++;
+        }
+        else if (get_land_at(m, t->x + 1, t->y - 1) == 0 &&
+                 t->x < m->land.width - 10)
+        {
+            t->x++;
+            t->y--;
+        }
+        else if (get_land_at(m, t->x, t->y - 1) == 0 ||
+                 get_land_at(m, t->x, t->y - 2) == 0 ||
+                 get_land_at(m, t->x, t->y - 3) == 0)
+        {
+            grav = false;
+            t->y--;
+        }
+        else
+        {
+            grav = false;
+        }
+    }
+
+    // Physics
+    if (t->y < 20)
+    {
+        t->y = 20;
+    }
+
+    if (grav)
+    {
+        if (get_land_at(m, t->x, t->y + 1) == 0)
+        {
+            t->y++;
+        }
+        if (get_land_at(m, t->x, t->y + 1) == 0)
+        {
+            t->y++;
+        }
+    }
+
+    // Aim
+    if (m->players[id].kup && t->angle < 90)
+    {
+        t->angle++;
+    }
+    else if (m->players[id].kdown && t->angle > 1)
+    {
+        t->angle--;
+    }
+}
+
+void tank_update(struct moag *m, int id)
+{
+    struct tank *t = &m->players[id].tank;
+
+    if (!m->players[id].connected)
+        return;
+
+    if (m->players[id].spawn_timer > 0)
+    {
+        if (--m->players[id].spawn_timer <= 0)
+            spawn_tank(m, id);
+        return;
+    }
+
+    if (m->players[id].ladder_timer >= 0 && (!m->players[id].kleft || !m->players[id].kright))
+        m->players[id].ladder_timer = LADDER_TIME;
+
+    if (m->players[id].kleft && m->players[id].kright)
+    {
+        if (m->players[id].ladder_timer > 0)
+        {
+            if (get_land_at(m, t->x, t->y + 1))
+                m->players[id].ladder_timer--;
+            else
+                m->players[id].ladder_timer = LADDER_TIME;
+        }
+        else if (m->players[id].ladder_timer == 0)
+        {
+            if (m->players[id].ladder_count > 0)
+            {
+                launch_ladder(m, t->x, t->y);
+                m->players[id].ladder_count--;
+            }
+            m->players[id].ladder_timer = LADDER_TIME;
+        }
+    }
+
+    tank_move(m, id);
+
+    if (abs(t->x - m->crate.x) < 14 && abs(t->y - m->crate.y) < 14)
+    {
+        m->players[id].ladder_timer = LADDER_TIME;
+        if (m->crate.type == TRIPLER)
+            t->num_burst *= 3;
+        else
+            t->bullet = m->crate.type;
+        m->crate.active = false;
+        add_event(m, EVENT_CRATE_TAKEN, 0);
+        char *notice = add_event(m, EVENT_NOTICE, id)->notice;
+        strcpy(notice, "* ");
+        strcat(notice, m->players[id].name);
+        strcat(notice, " got ");
+        switch (m->crate.type)
+        {
+            case  0: strcat(notice, "Missile"); break;
+            case  1: strcat(notice, "Baby Nuke"); break;
+            case  2: strcat(notice, "Nuke"); break;
+            case  3: strcat(notice, "Dirtball"); break;
+            case  4: strcat(notice, "Super Dirtball"); break;
+            case  5: strcat(notice, "Collapse"); break;
+            case  6: strcat(notice, "Liquid Dirt"); break;
+            case  7: strcat(notice, "Bouncer"); break;
+            case  8: strcat(notice, "Tunneler"); break;
+            case 10: strcat(notice, "MIRV"); break;
+            case 12: strcat(notice, "Cluster Bomb"); break;
+            case 13: strcat(notice, "Cluster Bouncer"); break;
+            case 14: strcat(notice, "Shotgun"); break;
+            case 16: strcat(notice, "*Triple*"); break;
+            default: strcat(notice, "???"); ERR("BTYPE: %d\n", m->crate.type); break;
+        }
+    }
+
+    // Fire
+    if (t->power)
+    {
+        float burst_spread = 4.0;
+        if (t->bullet == SHOTGUN)
+        {
+            t->num_burst *= SHOTGUN_PELLETS;
+            burst_spread = 2.0;
+        }
+        int num_burst = t->bullet == MISSILE ? 1 : t->num_burst;
+        float start_angle = t->facingleft ? 180 - t->angle : t->angle;
+        start_angle -= (num_burst-1)*burst_spread/2.0;
+        for (int i = 0; i < num_burst; i++)
+        {
+            fire_bullet_ang(m, t->bullet, t->x, t->y - 7,
+                            start_angle + i*burst_spread,
+                            (float)t->power * 0.01);
+        }
+        if (t->bullet != MISSILE)
+            t->num_burst = 1;
+        t->bullet = MISSILE;
+        t->power = 0;
+    }
+}
+
+void bounce_bullet(struct moag *m, int id, float hitx, float hity)
+{
+    struct bullet *b = &m->bullets[id];
+    const int ix = (int)hitx;
+    const int iy = (int)hity;
+
+    if (get_land_at(m, ix, iy) == -1)
+    {
+        b->obj.vel = VEC2_MUL_CONST(b->obj.vel, -1);
+        return;
+    }
+
+    b->obj.pos = VEC2(hitx, hity);
+    b->x = ix;
+    b->y = iy;
+
+    unsigned char hit = 0;
+    if (get_land_at(m, ix - 1, iy - 1)) hit |= 1 << 7;
+    if (get_land_at(m, ix    , iy - 1)) hit |= 1 << 6;
+    if (get_land_at(m, ix + 1, iy - 1)) hit |= 1 << 5;
+    if (get_land_at(m, ix - 1, iy    )) hit |= 1 << 4;
+    if (get_land_at(m, ix + 1, iy    )) hit |= 1 << 3;
+    if (get_land_at(m, ix - 1, iy + 1)) hit |= 1 << 2;
+    if (get_land_at(m, ix    , iy + 1)) hit |= 1 << 1;
+    if (get_land_at(m, ix + 1, iy + 1)) hit |= 1;
+
+    const float IRT2 = 0.70710678;
+    const float vx = b->obj.vel.x;
+    const float vy = b->obj.vel.y;
+
+    switch (hit)
+    {
+        case 0x00: break;
+
+        case 0x07: case 0xe0: case 0x02: case 0x40:
+            b->obj.vel.y = -vy;
+            break;
+
+        case 0x94: case 0x29: case 0x10: case 0x08:
+            b->obj.vel.x = -vx;
+            break;
+
+        case 0x16: case 0x68: case 0x04: case 0x20:
+            b->obj.vel.y = vx;
+            b->obj.vel.x = vy;
+            break;
+
+        case 0xd0: case 0x0b: case 0x80: case 0x01:
+            b->obj.vel.y = -vx;
+            b->obj.vel.x = -vy;
+            break;
+
+        case 0x17: case 0xe8: case 0x06: case 0x60:
+            b->obj.vel.x = +vx * IRT2 + vy * IRT2;
+            b->obj.vel.y = -vy * IRT2 + vx * IRT2;
+            break;
+
+        case 0x96: case 0x69: case 0x14: case 0x28:
+            b->obj.vel.x = -vx * IRT2 + vy * IRT2;
+            b->obj.vel.y = +vy * IRT2 + vx * IRT2;
+            break;
+
+        case 0xf0: case 0x0f: case 0xc0: case 0x03:
+            b->obj.vel.x = +vx * IRT2 - vy * IRT2;
+            b->obj.vel.y = -vy * IRT2 - vx * IRT2;
+            break;
+
+        case 0xd4: case 0x2b: case 0x90: case 0x09:
+            b->obj.vel.x = -vx * IRT2 - vy * IRT2;
+            b->obj.vel.y = +vy * IRT2 - vx * IRT2;
+            break;
+
+        default:
+            b->obj.vel.x = -vx;
+            b->obj.vel.y = -vy;
+            break;
+    }
+}
+
+void bullet_detonate(struct moag *m, int id)
+{
+    struct bullet *b = &m->bullets[id];
+    float d = VEC2_MAG(b->obj.vel);
+
+    if (d < 0.001 && d >- 0.001)
+        d = d < 0 ? -1 : 1;
+
+    const float dx = b->obj.vel.x / d;
+    const float dy = b->obj.vel.y / d;
+
+    float hitx = b->obj.pos.x;
+    float hity = b->obj.pos.y;
+
+    for (int i = 40; i > 0 && get_land_at(m, (int)hitx, (int)hity); i--)
+    {
+        hitx -= dx;
+        hity -= dy;
+    }
+
+    switch (b->type)
+    {
+        case MISSILE:
+            explode(m, b->x, b->y, 12, E_EXPLODE);
+            break;
+
+        case SHOTGUN:
+            explode(m, b->x, b->y, 6, E_EXPLODE);
+            break;
+
+        case BABY_NUKE:
+            explode(m, b->x, b->y, 55, E_EXPLODE);
+            break;
+
+        case NUKE:
+            explode(m, b->x, b->y, 150, E_EXPLODE);
+            break;
+
+        case DIRT:
+            explode(m, b->x, b->y, 55, E_DIRT);
+            break;
+
+        case SUPER_DIRT:
+            explode(m, b->x, b->y, 300, E_DIRT);
+            break;
+
+        case COLLAPSE:
+            explode(m, b->x, b->y, 120, E_COLLAPSE);
+            break;
+
+        case LIQUID_DIRT:
+            for (int i = 0; i < 4; i++)
+                set_timer(m, m->frame + 65*i, LIQUID_DIRT_WARHEAD,
+                        b->x, b->y, 0, 0);
+            break;
+
+        case LIQUID_DIRT_WARHEAD:
+            liquid(m, (int)hitx, (int)hity, 2000);
+            break;
+
+        case BOUNCER:
+            if (b->active > 0)
+                b->active = -BOUNCER_BOUNCES;
+            b->active++;
+            bounce_bullet(m, id, hitx, hity);
+            b->obj.vel = VEC2_MUL_CONST(b->obj.vel, 0.9);
+            explode(m, b->x, b->y, 12, E_EXPLODE);
+            break;
+
+        case TUNNELER:
+            if (b->active > 0)
+                b->active = -TUNNELER_TUNNELINGS;
+            b->active++;
+            explode(m, hitx, hity, 9, E_EXPLODE);
+            explode(m, hitx + 8 * dx, hity + 8 * dy, 9, E_EXPLODE);
+            break;
+
+        case LADDER: {
+            int x = b->x;
+            int y = b->y;
+            for (; y < m->land.height; y++)
+                if (get_land_at(m, x, y) == 0)
+                    break;
+            for (; y < m->land.height; y++)
+                if (get_land_at(m, x, y))
+                    break;
+            const int maxy = y + 1;
+            y = b->y;
+            for (; y > 0; y--)
+                if (get_land_at(m, x, y) == 0)
+                    break;
+            const int miny = y;
+            for(; y < maxy; y += 2)
+            {
+                set_land_at(m, x - 1, y,     0);
+                set_land_at(m, x    , y,     1);
+                set_land_at(m, x + 1, y,     0);
+                set_land_at(m, x - 1, y + 1, 1);
+                set_land_at(m, x    , y + 1, 1);
+                set_land_at(m, x + 1, y + 1, 1);
+            }
+            mark_land_dirty(m, x - 1, miny, 3, maxy - miny + 1);
+            break;
+        }
+
+        case MIRV:
+            bounce_bullet(m, id, hitx, hity);
+            explode(m, b->x, b->y, 12, E_EXPLODE);
+            for (int i = -3; i < 4; i++)
+                fire_bullet(m, MIRV_WARHEAD,
+                            b->x, b->y,
+                            b->obj.vel.x + i, b->obj.vel.y);
+            break;
+
+        case MIRV_WARHEAD:
+            explode(m, b->x, b->y, 30, E_EXPLODE);
+            break;
+
+        case CLUSTER_BOMB:
+            bounce_bullet(m, id, hitx, hity);
+            explode(m, b->x, b->y, 20, E_EXPLODE);
+            for (int i = 0; i < 11; i++)
+                fire_bullet(m, MISSILE, hitx, hity,
+                            2.0 * cosf(i * M_PI / 5.5) + 0.50 * b->obj.vel.x,
+                            2.0 * sinf(i * M_PI / 5.5) + 0.50 * b->obj.vel.y);
+            break;
+
+        case CLUSTER_BOUNCER:
+            bounce_bullet(m, id, hitx, hity);
+            explode(m, b->x, b->y, 20, E_EXPLODE);
+            for (int i = 0; i < 11; i++)
+                fire_bullet(m, BOUNCER, hitx, hity,
+                            2.0 * cosf(i * M_PI / 5.5) + 0.50 * b->obj.vel.x,
+                            2.0 * sinf(i * M_PI / 5.5) + 0.50 * b->obj.vel.y);
+            break;
+
+        default: break;
+    }
+
+    if (b->active >= 0)
+    {
+        b->active = 0;
+        add_event(m, EVENT_BULLET_KILLED, id);
+    }
+}
+
+static void bullet_step(struct moag *m, int id)
+{
+    struct bullet *b = &m->bullets[id];
+
+    if (b->type == LADDER)
+    {
+        b->active--;
+        bullet_fly(b);
+
+        if (get_land_at(m, b->x, b->y) == 1)
+        {
+            explode(m, b->x, b->y + LADDER_LENGTH - b->active, 1, E_SAFE_EXPLODE);
+            bullet_detonate(m, id);
+        }
+        else if (!b->active)
+        {
+            /* Ran out without detonating. */
+            add_event(m, EVENT_BULLET_KILLED, id);
+        }
+        return;
+    }
+
+    bullet_fly(b);
+    if (get_land_at(m, b->x, b->y))
+    {
+        bullet_detonate(m, id);
+        return;
+    }
+
+    if (b->active > 1)
+    {
+        b->active--;
+        return;
+    }
+
+    if (b->type == BOUNCER && b->active == 1)
+        b->active = -BOUNCER_BOUNCES;
+    if (b->type == TUNNELER && b->active == 1)
+        b->active = -TUNNELER_TUNNELINGS;
+
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        if(DIST(m->players[i].tank.x, m->players[i].tank.y - 3,
+                b->x, b->y) < 8.5)
+        {
+            bullet_detonate(m, id);
+            return;
+        }
+    }
+
+    if (m->crate.active && DIST(m->crate.x, m->crate.y - 4, b->x, b->y) < 5.5)
+    {
+        if (m->crate.type == TRIPLER) {
+            float angle = -RAD2DEG(atan2(b->obj.vel.y, b->obj.vel.x));
+            float speed = VEC2_MAG(b->obj.vel);
+            fire_bullet_ang(m, b->type, b->x, b->y, angle - 20.0, speed);
+            fire_bullet_ang(m, b->type, b->x, b->y, angle + 20.0, speed);
+        } else if (m->crate.type == SHOTGUN) {
+            bullet_detonate(m, id);
+            float angle = -RAD2DEG(atan2(b->obj.vel.y, b->obj.vel.x));
+            float speed = VEC2_MAG(b->obj.vel);
+            int shots = SHOTGUN_PELLETS;
+            for (int i = 0; i < shots; i++)
+                fire_bullet_ang(m, m->crate.type, m->crate.x, m->crate.y - 4,
+                        angle - (shots-1)*2 + i*4, speed*0.5);
+        } else {
+            bullet_detonate(m, id);
+            fire_bullet(m, m->crate.type, m->crate.x, m->crate.y - 4,
+                           m->crate.type != BOUNCER ? 0 :
+                           b->obj.vel.x < 0 ? -0.2 :
+                                               0.2, -0.2);
+        }
+        m->crate.active = false;
+        return;
+    }
+
+    if (b->type == MIRV && b->obj.vel.y > 0)
+    {
+        bullet_detonate(m, id);
+        return;
+    }
+}
+
+void bullet_update(struct moag *m, int id)
+{
+    struct bullet *b = &m->bullets[id];
+
+    if (!b->active)
+        return;
+
+    /* Clients fly bullets too, they only need telling if it went elsewhere. */
+    struct bullet flown = *b;
+    bullet_fly(&flown);
+
+    bullet_step(m, id);
+
+    if (b->active && (b->obj.pos.x != flown.obj.pos.x || b->obj.pos.y != flown.obj.pos.y ||
+                      b->obj.vel.x != flown.obj.vel.x || b->obj.vel.y != flown.obj.vel.y))
+        add_event(m, EVENT_BULLET_CHANGED, id);
+}
+
+void crate_update(struct moag *m)
+{
+    if (!m->crate.active)
+    {
+        m->crate.active = true;
+        m->crate.x = rng_range(&m->rng, 20, m->land.width - 20);
+        m->crate.y = 30;
+        explode(m, m->crate.x, m->crate.y - 12, 12, E_SAFE_EXPLODE);
+
+        const int PBABYNUKE = 100;
+        const int PNUKE = 20;
+        const int PDIRT = 75;
+        const int PSUPERDIRT = 15;
+        const int PLIQUIDDIRT = 60;
+        const int PCOLLAPSE = 60;
+        const int PBOUNCER = 100;
+        const int PTUNNELER = 75;
+        const int PMIRV = 40;
+        const int PCLUSTER = 60;
+        const int PCLUSTERB = 10;
+        const int PSHOTGUN = 100;
+        const int PTRIPLER = 40;
+        // add new ones here:
+        const int TOTAL = PBABYNUKE + PNUKE + PDIRT + PSUPERDIRT + PLIQUIDDIRT +
+                          PCOLLAPSE + PBOUNCER + PTUNNELER + PMIRV + PCLUSTER +
+                          PCLUSTERB + PSHOTGUN + PTRIPLER;
+        int r = rng_range(&m->rng, 0, TOTAL);
+             if ((r -= PBABYNUKE) < 0)   m->crate.type = BABY_NUKE;
+        else if ((r -= PNUKE) < 0)       m->crate.type = NUKE;
+        else if ((r -= PSUPERDIRT) < 0)  m->crate.type = SUPER_DIRT;
+        else if ((r -= PLIQUIDDIRT) < 0) m->crate.type = LIQUID_DIRT;
+        else if ((r -= PCOLLAPSE) < 0)   m->crate.type = COLLAPSE;
+        else if ((r -= PBOUNCER) < 0)    m->crate.type = BOUNCER;
+        else if ((r -= PTUNNELER) < 0)   m->crate.type = TUNNELER;
+        else if ((r -= PMIRV) < 0)       m->crate.type = MIRV;
+        else if ((r -= PCLUSTER) < 0)    m->crate.type = CLUSTER_BOMB;
+        else if ((r -= PCLUSTERB) < 0)   m->crate.type = CLUSTER_BOUNCER;
+        else if ((r -= PSHOTGUN) < 0)    m->crate.type = SHOTGUN;
+        else if ((r -= PTRIPLER) < 0)    m->crate.type = TRIPLER;
+        else                             m->crate.type = DIRT;
+        add_event(m, EVENT_CRATE_SPAWNED, 0);
+    }
+
+    if (get_land_at(m, m->crate.x, m->crate.y + 1) == 0)
+    {
+        m->crate.y++;
+    }
+}
+
+void timer_update(struct moag *m, int id)
+{
+    struct timer *t = &m->timers[id];
+    if (t->frame && t->frame <= m->frame)
+    {
+        fire_bullet(m, t->type, t->x, t->y, t->vx, t->vy);
+        t->frame = 0;
+    }
+}
+
+/* Updates the bullets in use when this is called, then unlists the ones that
+ * are done and frees their slots. Bullets fired meanwhile are listed after
+ * them and first updated next tick. */
+static void update_bullets(struct moag *m)
+{
+    int n = m->num_bullets, kept = 0;
+    for (int i = 0; i < n; i++)
+    {
+        int id = m->live_bullets[i];
+        bullet_update(m, id);
+        if (m->bullets[id].active)
+            m->live_bullets[kept++] = id;
+        else
+            m->free_bullets[m->num_free_bullets++] = id;
+    }
+    memmove(&m->live_bullets[kept], &m->live_bullets[n],
+            (m->num_bullets - n) * sizeof *m->live_bullets);
+    m->num_bullets -= n - kept;
+}
+
+/* Like update_bullets(), for timers. */
+static void update_timers(struct moag *m)
+{
+    int n = m->num_timers, kept = 0;
+    for (int i = 0; i < n; i++)
+    {
+        int id = m->live_timers[i];
+        timer_update(m, id);
+        if (m->timers[id].frame)
+            m->live_timers[kept++] = id;
+        else
+            m->free_timers[m->num_free_timers++] = id;
+    }
+    memmove(&m->live_timers[kept], &m->live_timers[n],
+            (m->num_timers - n) * sizeof *m->live_timers);
+    m->num_timers -= n - kept;
+}
+
+void step_game(struct moag *m)
+{
+    crate_update(m);
+    for (int i = 0; i < MAX_PLAYERS; i++)
+        tank_update(m, i);
+    update_bullets(m);
+    update_timers(m);
+    run_terrain_jobs(m, m->terrain_budget_us);
+    m->frame += 1;
+}
+
+void init_game(struct moag *m, int width, int height)
+{
+    for (int i = 0; i < MAX_PLAYERS; i++)
+        m->players[i].connected = 0;
+    for (int i = 0; i < MAX_BULLETS; i++)
+        m->bullets[i].active = 0;
+    for (int i = 0; i < MAX_TIMERS; i++)
+        m->timers[i].frame = 0;
+    reset_slots(m->free_bullets, &m->num_free_bullets, &m->num_bullets, MAX_BULLETS);
+    reset_slots(m->free_timers, &m->num_free_timers, &m->num_timers, MAX_TIMERS);
+    m->crate.active = false;
+    m->frame = 1;
+    m->num_dirty = 0;
+    m->events = NULL;
+    m->num_events = 0;
+    m->max_events = 0;
+    m->jobs = NULL;
+    m->first_job = 0;
+    m->num_jobs = 0;
+    m->max_jobs = 0;
+    m->terrain_budget_us = DEFAULT_TERRAIN_BUDGET_US;
+
+    rng_seed(&m->rng, time(NULL));
+
+    land_init(&m->land, width, height);
+    for (int y = height / 3; y < height; ++y)
+        land_fill_span(&m->land, 0, width, y, true);
+    land_compact(&m->land, 0, 0, width, height);
+}
+
+void game_join(struct moag *m, int id)
+{
+    sprintf(m->players[id].name, "p%d", id);
+    spawn_tank(m, id);
+}
+
+void game_leave(struct moag *m, int id)
+{
+    m->players[id].connected = 0;
+    add_event(m, EVENT_TANK_KILLED, id);
+}
+
+void game_input(struct moag *m, int id, int key, uint16_t ms)
+{
+    switch (key)
+    {
+        case KLEFT_PRESSED:   m->players[id].kleft = true; break;
+        case KLEFT_RELEASED:  m->players[id].kleft = false; break;
+        case KRIGHT_PRESSED:  m->players[id].kright = true; break;
+        case KRIGHT_RELEASED: m->players[id].kright = false; break;
+        case KUP_PRESSED:     m->players[id].kup = true; break;
+        case KUP_RELEASED:    m->players[id].kup = false; break;
+        case KDOWN_PRESSED:   m->players[id].kdown = true; break;
+        case KDOWN_RELEASED:  m->players[id].kdown = false; break;
+        case KFIRE_PRESSED:   m->players[id].kfire = true; break;
+        case KFIRE_RELEASED:
+            m->players[id].kfire = false;
+            m->players[id].tank.power = ms / 2;
+            m->players[id].tank.power = CLAMP(0, 1000, m->players[id].tank.power);
+            break;
+    }
+}
+
+void clear_land_dirty(struct moag *m)
+{
+    for (int i = 0; i < m->num_dirty; i++)
+    {
+        struct land_rect *r = &m->dirty[i];
+        land_compact(&m->land, r->x, r->y, r->w, r->h);
+    }
+    m->num_dirty = 0;
+}
+
+size_t pack_land(struct moag *m, int x, int y, int w, int h, uint8_t *dst)
+{
+    struct rlencoder enc;
+    rlencode_begin(&enc, dst);
+    for (int yy = y; yy < h + y; ++yy)
+    {
+        int xx = x;
+        while (xx < w + x)
+        {
+            bool solid = land_solid_at(&m->land, xx, yy);
+            int end = MIN(land_find(&m->land, xx, yy, 1, !solid), w + x);
+            rlencode_put(&enc, solid, end - xx);
+            xx = end;
+        }
+    }
+    return rlencode_end(&enc);
+}
+
+void unpack_land(struct moag *m, int x, int y, int w, int h, const uint8_t *src, size_t len)
+{
+    /* Decoded straight into the map a span at a time. */
+    const size_t area = (size_t)w * h;
+    size_t i = 0;
+
+    for (size_t p = 0; p + 1 < len && i < area; p += 2)
+    {
+        bool solid = src[p] != 0;
+        size_t n = MIN((size_t)src[p + 1] + 1, area - i);
+        while (n > 0)
+        {
+            /* Runs carry on into the next row. */
+            int xx = i % w;
+            int run = MIN(n, (size_t)(w - xx));
+            land_fill_span(&m->land, x + xx, x + xx + run, y + i / w, solid);
+            i += run;
+            n -= run;
+        }
+    }
+    land_compact(&m->land, x, y, w, h);
+}
+
+/* Sizes of the parts of a game state, see write_game_state(). */
+#define STATE_HEADER_SIZE   (4 + 4 * XOR128_K + 2 + 2)
+#define STATE_PLAYER_SIZE   (1 + MAX_NAME_LEN + 4 + 4 + 4 + 1 + 4 + 4 + 4 + 4 + 1 + 4 + 1)
+#define STATE_BULLET_SIZE   (1 + 1 + 4 + 4 + 8 + 8 + 8 + 8)
+#define STATE_TIMER_SIZE    (4 + 1 + 4 + 4 + 4 + 4)
+#define STATE_CRATE_SIZE    (1 + 1 + 4 + 4)
+#define STATE_FIXED_SIZE    (STATE_HEADER_SIZE + MAX_PLAYERS * STATE_PLAYER_SIZE + \
+                             2 + 2 + STATE_CRATE_SIZE + 4)
+
+static uint8_t player_keys(const struct player *p)
+{
+    return p->kleft | p->kright << 1 | p->kup << 2 | p->kdown << 3 | p->kfire << 4;
+}
+
+size_t write_game_state(struct moag *m, uint8_t *dst)
+{
+    const size_t land_len = pack_land(m, 0, 0, m->land.width, m->land.height, NULL);
+    if (!dst)
+        return STATE_FIXED_SIZE + m->num_bullets * STATE_BULLET_SIZE +
+               m->num_timers * STATE_TIMER_SIZE + land_len;
+
+    size_t pos = 0;
+    write32(dst, &pos, m->frame);
+    for (int i = 0; i < XOR128_K; i++)
+        write32(dst, &pos, m->rng.q[i]);
+    write16(dst, &pos, m->land.width);
+    write16(dst, &pos, m->land.height);
+
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        struct player *p = &m->players[i];
+        write8(dst, &pos, p->connected);
+        write_bytes(dst, &pos, p->name, MAX_NAME_LEN);
+        write32(dst, &pos, p->spawn_timer);
+        write32(dst, &pos, p->ladder_count);
+        write32(dst, &pos, p->ladder_timer);
+        write8(dst, &pos, player_keys(p));
+        write32(dst, &pos, p->tank.x);
+        write32(dst, &pos, p->tank.y);
+        write32(dst, &pos, p->tank.angle);
+        write32(dst, &pos, p->tank.power);
+        write8(dst, &pos, p->tank.bullet);
+        write32(dst, &pos, p->tank.num_burst);
+        write8(dst, &pos, p->tank.facingleft);
+    }
+
+    write16(dst, &pos, m->num_bullets);
+    for (int i = 0; i < m->num_bullets; i++)
+    {
+        struct bullet *b = &m->bullets[m->live_bullets[i]];
+        write8(dst, &pos, b->active);
+        write8(dst, &pos, b->type);
+        write32(dst, &pos, b->x);
+        write32(dst, &pos, b->y);
+        write_double(dst, &pos, b->obj.pos.x);
+        write_double(dst, &pos, b->obj.pos.y);
+        write_double(dst, &pos, b->obj.vel.x);
+        write_double(dst, &pos, b->obj.vel.y);
+    }
+
+    write16(dst, &pos, m->num_timers);
+    for (int i = 0; i < m->num_timers; i++)
+    {
+        struct timer *t = &m->timers[m->live_timers[i]];
+        write32(dst, &pos, t->frame);
+        write8(dst, &pos, t->type);
+        write_float(dst, &pos, t->x);
+        write_float(dst, &pos, t->y);
+        write_float(dst, &pos, t->vx);
+        write_float(dst, &pos, t->vy);
+    }
+
+    write8(dst, &pos, m->crate.active);
+    write8(dst, &pos, m->crate.type);
+    write32(dst, &pos, m->crate.x);
+    write32(dst, &pos, m->crate.y);
+
+    write32(dst, &pos, land_len);
+    pos += pack_land(m, 0, 0, m->land.width, m->land.height, dst + pos);
+    return pos;
+}
+
+bool read_game_state(struct moag *m, const uint8_t *src, size_t len)
+{
+    if (len < STATE_FIXED_SIZE)
+        return false;
+
+    size_t pos = 0;
+    m->frame = read32(src, &pos);
+    for (int i = 0; i < XOR128_K; i++)
+        m->rng.q[i] = read32(src, &pos);
+    int width = read16(src, &pos);
+    int height = read16(src, &pos);
+    if (!land_size_valid(width, height))
+        return false;
+
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        struct player *p = &m->players[i];
+        p->connected = read8(src, &pos) != 0;
+        memcpy(p->name, src + pos, MAX_NAME_LEN);
+        p->name[MAX_NAME_LEN - 1] = '\0';
+        pos += MAX_NAME_LEN;
+        p->spawn_timer = read32(src, &pos);
+        p->ladder_count = read32(src, &pos);
+        p->ladder_timer = (int32_t)read32(src, &pos);
+        uint8_t keys = read8(src, &pos);
+        p->kleft = keys & 1;
+        p->kright = keys >> 1 & 1;
+        p->kup = keys >> 2 & 1;
+        p->kdown = keys >> 3 & 1;
+        p->kfire = keys >> 4 & 1;
+        p->tank.x = (int32_t)read32(src, &pos);
+        p->tank.y = (int32_t)read32(src, &pos);
+        p->tank.angle = (int32_t)read32(src, &pos);
+        p->tank.power = (int32_t)read32(src, &pos);
+        p->tank.bullet = read8(src, &pos);
+        p->tank.num_burst = (int32_t)read32(src, &pos);
+        p->tank.facingleft = read8(src, &pos) != 0;
+        p->tank.obj.pos = VEC2(p->tank.x, p->tank.y);
+        p->tank.obj.vel = VEC2(0, 0);
+        if (p->tank.bullet < 0 || p->tank.bullet > TRIPLER)
+            return false;
+    }
+
+    /* Slots are taken again in the order they're listed, their ids don't
+     * matter to how the game goes. */
+    for (int i = 0; i < MAX_BULLETS; i++)
+        m->bullets[i].active = 0;
+    for (int i = 0; i < MAX_TIMERS; i++)
+        m->timers[i].frame = 0;
+    reset_slots(m->free_bullets, &m->num_free_bullets, &m->num_bullets, MAX_BULLETS);
+    reset_slots(m->free_timers, &m->num_free_timers, &m->num_timers, MAX_TIMERS);
+
+    int num_bullets = read16(src, &pos);
+    if (num_bullets > MAX_BULLETS || len - pos < num_bullets * STATE_BULLET_SIZE + 2 +
+                                                 STATE_CRATE_SIZE + 4)
+        return false;
+    for (int i = 0; i < num_bullets; i++)
+    {
+        int id = take_slot(m->live_bullets, &m->num_bullets, m->free_bullets, &m->num_free_bullets);
+        struct bullet *b = &m->bullets[id];
+        b->active = read8(src, &pos);
+        b->type = read8(src, &pos);
+        b->x = (int32_t)read32(src, &pos);
+        b->y = (int32_t)read32(src, &pos);
+        b->obj.pos.x = read_double(src, &pos);
+        b->obj.pos.y = read_double(src, &pos);
+        b->obj.vel.x = read_double(src, &pos);
+        b->obj.vel.y = read_double(src, &pos);
+        if (b->type < 0 || b->type > TRIPLER)
+            return false;
+    }
+
+    int num_timers = read16(src, &pos);
+    if (num_timers > MAX_TIMERS || len - pos < num_timers * STATE_TIMER_SIZE +
+                                               STATE_CRATE_SIZE + 4)
+        return false;
+    for (int i = 0; i < num_timers; i++)
+    {
+        int id = take_slot(m->live_timers, &m->num_timers, m->free_timers, &m->num_free_timers);
+        struct timer *t = &m->timers[id];
+        t->frame = (int32_t)read32(src, &pos);
+        t->type = read8(src, &pos);
+        t->x = read_float(src, &pos);
+        t->y = read_float(src, &pos);
+        t->vx = read_float(src, &pos);
+        t->vy = read_float(src, &pos);
+        if (t->type < 0 || t->type > TRIPLER)
+            return false;
+    }
+
+    m->crate.active = read8(src, &pos) != 0;
+    m->crate.type = read8(src, &pos);
+    m->crate.x = (int32_t)read32(src, &pos);
+    m->crate.y = (int32_t)read32(src, &pos);
+    if (m->crate.type < 0 || m->crate.type > TRIPLER)
+        return false;
+
+    size_t land_len = read32(src, &pos);
+    if (land_len != len - pos)
+        return false;
+
+    land_free(&m->land);
+    land_init(&m->land, width, height);
+    unpack_land(m, 0, 0, width, height, src + pos, land_len);
+
+    m->num_dirty = 0;
+    m->num_events = 0;
+    m->first_job = 0;
+    m->num_jobs = 0;
+    m->terrain_budget_us = 0;
+    return true;
+}
+
+/* FNV-1a, a byte at a time from the lowest so it's the same on any machine. */
+static uint32_t hash_u64(uint32_t h, uint64_t val, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        h ^= (val >> (i * 8)) & 0xff;
+        h *= 16777619;
+    }
+    return h;
+}
+
+static uint32_t hash_int(uint32_t h, int32_t val)
+{
+    return hash_u64(h, (uint32_t)val, 4);
+}
+
+static uint32_t hash_float(uint32_t h, float val)
+{
+    uint32_t bits;
+    memcpy(&bits, &val, sizeof bits);
+    return hash_u64(h, bits, 4);
+}
+
+static uint32_t hash_double(uint32_t h, double val)
+{
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof bits);
+    return hash_u64(h, bits, 8);
+}
+
+uint32_t game_checksum(struct moag *m)
+{
+    uint32_t h = 2166136261u;
+
+    h = hash_int(h, m->frame);
+    for (int i = 0; i < XOR128_K; i++)
+        h = hash_int(h, m->rng.q[i]);
+
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        struct player *p = &m->players[i];
+        h = hash_int(h, p->connected);
+        if (!p->connected)
+            continue;
+        h = hash_int(h, p->spawn_timer);
+        h = hash_int(h, p->ladder_count);
+        h = hash_int(h, p->ladder_timer);
+        h = hash_int(h, player_keys(p));
+        h = hash_int(h, p->tank.x);
+        h = hash_int(h, p->tank.y);
+        h = hash_int(h, p->tank.angle);
+        h = hash_int(h, p->tank.power);
+        h = hash_int(h, p->tank.bullet);
+        h = hash_int(h, p->tank.num_burst);
+        h = hash_int(h, p->tank.facingleft);
+    }
+
+    h = hash_int(h, m->num_bullets);
+    for (int i = 0; i < m->num_bullets; i++)
+    {
+        struct bullet *b = &m->bullets[m->live_bullets[i]];
+        h = hash_int(h, b->active);
+        h = hash_int(h, b->type);
+        h = hash_double(h, b->obj.pos.x);
+        h = hash_double(h, b->obj.pos.y);
+        h = hash_double(h, b->obj.vel.x);
+        h = hash_double(h, b->obj.vel.y);
+    }
+
+    h = hash_int(h, m->num_timers);
+    for (int i = 0; i < m->num_timers; i++)
+    {
+        struct timer *t = &m->timers[m->live_timers[i]];
+        h = hash_int(h, t->frame);
+        h = hash_int(h, t->type);
+        h = hash_float(h, t->x);
+        h = hash_float(h, t->y);
+        h = hash_float(h, t->vx);
+        h = hash_float(h, t->vy);
+    }
+
+    h = hash_int(h, m->crate.active);
+    h = hash_int(h, m->crate.type);
+    h = hash_int(h, m->crate.x);
+    h = hash_int(h, m->crate.y);
+
+    /* Only the land changed since the last checksum is hashed again. */
+    h = hash_u64(h, land_hash(&m->land), 8);
+
+    return h ? h : 1;
+}
@@ -0,0 +1,81 @@
+
+#ifndef GAME_H
+#define GAME_H
+
+#include "common.h"
+#include "moag.h"
+
+#define BOUNCER_BOUNCES     11
+#define TUNNELER_TUNNELINGS 20
+#define SHOTGUN_PELLETS     6
+#define RESPAWN_TIME        40
+#define LADDER_TIME         60
+#define LADDER_LENGTH       64
+
+/* Time between ticks, unless the server is started with another. */
+#define DEFAULT_TICK_MS     10
+
+/* Terrain jobs are run in slices of this much work, as many as fit in the
+ * tick's budget. A slice is kept small so it can't overrun the budget by much.
+ */
+#define CARVE_ROWS_PER_SLICE        16
+#define COLLAPSE_COLUMNS_PER_SLICE  8
+#define POUR_CELLS_PER_SLICE        256
+#define DEFAULT_TERRAIN_BUDGET_US   2000
+
+enum
+{
+    E_EXPLODE,
+    E_DIRT,
+    E_SAFE_EXPLODE,
+    E_COLLAPSE
+};
+
+/* The simulation. Nothing in here touches the network, it only depends on the
+ * moag it's given and the inputs applied to it, so any number of copies step
+ * the same way as long as they start from the same state and are given the
+ * same inputs before the same frames. Terrain jobs must then be run with a
+ * budget of 0, a time budget depends on the machine.
+ */
+void init_game(struct moag *m, int width, int height);
+void step_game(struct moag *m);
+
+void game_join(struct moag *m, int id);
+void game_leave(struct moag *m, int id);
+void game_input(struct moag *m, int id, int key, uint16_t ms);
+
+/* Runs terrain jobs for up to budget_us microseconds, or until there are none
+ * left if budget_us is 0. Returns the number of slices run. */
+int run_terrain_jobs(struct moag *m, uint64_t budget_us);
+
+/* One tick of a tank's movement by the keys its player holds, which is all
+ * clients need to move their own tank ahead of the server. */
+void tank_move(struct moag *m, int id);
+
+/* Frees tiles the land changed this tick left uniform, and forgets it. */
+void clear_land_dirty(struct moag *m);
+
+/* Run-length encodes a rectangle of land into dst, or only measures it if dst
+ * is NULL. Returns the packed length.
+ */
+size_t pack_land(struct moag *m, int x, int y, int w, int h, uint8_t *dst);
+/* Decodes packed land into a rectangle, runs past the rectangle are ignored. */
+void unpack_land(struct moag *m, int x, int y, int w, int h, const uint8_t *src, size_t len);
+
+/* The whole world, for starting another copy of the game. Only valid between
+ * ticks with no terrain jobs left. write_game_state only measures if dst is
+ * NULL, read_game_state returns false if the state is malformed.
+ */
+size_t write_game_state(struct moag *m, uint8_t *dst);
+bool read_game_state(struct moag *m, const uint8_t *src, size_t len);
+
+/* Hash of everything that affects how the game goes on, never 0. The land is
+ * hashed a tile at a time and only tiles written to since the last checksum
+ * are hashed again, so this is cheap enough to do every tick. */
+uint32_t game_checksum(struct moag *m);
+
+/* Everything the game does is queued on m->events for whatever runs it to
+ * pass on, which forgets them once it has. */
+void clear_game_events(struct moag *m);
+
+#endif
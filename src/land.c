@@ -0,0 +1,463 @@
+
+#include "common.h"
+
+#define WORD_MASK_FROM(b) (~(uint64_t)0 << (b))
+#define WORD_MASK_UPTO(b) ((b) == LAND_WORD_BITS - 1 ? ~(uint64_t)0 : \
+                                                       ((uint64_t)1 << ((b) + 1)) - 1)
+
+#if defined(__GNUC__)
+#   define LOWEST_BIT(w)  __builtin_ctzll(w)
+#   define HIGHEST_BIT(w) (63 - __builtin_clzll(w))
+#else
+static inline int LOWEST_BIT(uint64_t w)
+{
+    int b = 0;
+    while (!(w & 1)) { w >>= 1; b++; }
+    return b;
+}
+
+static inline int HIGHEST_BIT(uint64_t w)
+{
+    int b = 0;
+    while (w >>= 1) b++;
+    return b;
+}
+#endif
+
+/* Row y of tile column w. */
+static inline uint64_t land_word(const struct land *l, int w, int y)
+{
+    const int i = (y / LAND_TILE_SIZE) * l->tiles_w + w;
+    if (!l->tiles[i])
+        return l->uniform[i] ? ~(uint64_t)0 : 0;
+    return l->tiles[i]->rows[y % LAND_TILE_SIZE];
+}
+
+/* Row y of tile column w, splitting its tile if it's uniform. */
+static inline uint64_t *land_word_ptr(struct land *l, int w, int y)
+{
+    const int i = (y / LAND_TILE_SIZE) * l->tiles_w + w;
+    struct land_tile *t = l->tiles[i] ? l->tiles[i] : land_split_tile(l, i);
+    land_touch_tile(l, i);
+    return &t->rows[y % LAND_TILE_SIZE];
+}
+
+/******************************************************************************\
+Tiles.
+\******************************************************************************/
+
+void land_init(struct land *l, int width, int height)
+{
+    l->width = width;
+    l->height = height;
+    l->tiles_w = (width + LAND_TILE_SIZE - 1) / LAND_TILE_SIZE;
+    l->tiles_h = (height + LAND_TILE_SIZE - 1) / LAND_TILE_SIZE;
+
+    const int n = l->tiles_w * l->tiles_h;
+    l->tiles = safe_malloc(n * sizeof *l->tiles);
+    l->uniform = safe_malloc(n);
+    l->tile_hash = safe_malloc(n * sizeof *l->tile_hash);
+    l->is_stale = safe_malloc(n);
+    l->stale = safe_malloc(n * sizeof *l->stale);
+    l->hash = 0;
+    l->num_stale = 0;
+    for (int i = 0; i < n; i++)
+    {
+        l->tiles[i] = NULL;
+        l->uniform[i] = 0;
+        l->tile_hash[i] = 0;
+        l->is_stale[i] = 0;
+        land_touch_tile(l, i);
+    }
+}
+
+void land_free(struct land *l)
+{
+    if (!l->tiles)
+        return;
+    for (int i = 0; i < l->tiles_w * l->tiles_h; i++)
+        free(l->tiles[i]);
+    free(l->tiles);
+    free(l->uniform);
+    free(l->tile_hash);
+    free(l->is_stale);
+    free(l->stale);
+    l->tiles = NULL;
+    l->uniform = NULL;
+    l->tile_hash = NULL;
+    l->is_stale = NULL;
+    l->stale = NULL;
+}
+
+struct land_tile *land_split_tile(struct land *l, int tile)
+{
+    struct land_tile *t = safe_malloc(sizeof *t);
+    const uint64_t fill = l->uniform[tile] ? ~(uint64_t)0 : 0;
+    for (int i = 0; i < LAND_TILE_SIZE; i++)
+        t->rows[i] = fill;
+    l->tiles[tile] = t;
+    return t;
+}
+
+/* Bits of a row of tile column tx that are inside the map. */
+static uint64_t land_tile_mask(const struct land *l, int tx)
+{
+    const int cols = l->width - tx * LAND_TILE_SIZE;
+    return cols >= LAND_TILE_SIZE ? ~(uint64_t)0 : ((uint64_t)1 << cols) - 1;
+}
+
+static uint64_t land_tile_hash(const struct land *l, int i)
+{
+    const int ty = i / l->tiles_w;
+    const int rows = MIN(LAND_TILE_SIZE, l->height - ty * LAND_TILE_SIZE);
+    const uint64_t mask = land_tile_mask(l, i % l->tiles_w);
+    const struct land_tile *t = l->tiles[i];
+    const uint64_t fill = l->uniform[i] ? ~(uint64_t)0 : 0;
+
+    /* Seeded with the tile's index so moving land around changes the hash. */
+    uint64_t h = 0x9e3779b97f4a7c15 * (uint64_t)(i + 1);
+    for (int r = 0; r < rows; r++)
+    {
+        h ^= (t ? t->rows[r] : fill) & mask;
+        h *= 0xff51afd7ed558ccd;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+uint64_t land_hash(struct land *l)
+{
+    for (int n = 0; n < l->num_stale; n++)
+    {
+        const int i = l->stale[n];
+        const uint64_t h = land_tile_hash(l, i);
+        l->hash ^= l->tile_hash[i] ^ h;
+        l->tile_hash[i] = h;
+        l->is_stale[i] = 0;
+    }
+    l->num_stale = 0;
+    return l->hash;
+}
+
+void land_compact(struct land *l, int x, int y, int w, int h)
+{
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    if (x + w > l->width) w = l->width - x;
+    if (y + h > l->height) h = l->height - y;
+    if (w <= 0 || h <= 0)
+        return;
+
+    for (int ty = y / LAND_TILE_SIZE; ty <= (y + h - 1) / LAND_TILE_SIZE; ty++)
+    {
+        for (int tx = x / LAND_TILE_SIZE; tx <= (x + w - 1) / LAND_TILE_SIZE; tx++)
+        {
+            const int i = ty * l->tiles_w + tx;
+            struct land_tile *t = l->tiles[i];
+            if (!t)
+                continue;
+
+            /* Tiles on the right and bottom edges are only partly used. */
+            const int rows = MIN(LAND_TILE_SIZE, l->height - ty * LAND_TILE_SIZE);
+            const uint64_t mask = land_tile_mask(l, tx);
+
+            const uint64_t first = t->rows[0] & mask;
+            if (first != 0 && first != mask)
+                continue;
+            int r = 1;
+            while (r < rows && (t->rows[r] & mask) == first)
+                r++;
+            if (r < rows)
+                continue;
+
+            l->uniform[i] = first != 0;
+            l->tiles[i] = NULL;
+            free(t);
+        }
+    }
+}
+
+/******************************************************************************\
+Word at a time row operations.
+\******************************************************************************/
+
+void land_fill_span(struct land *l, int x0, int x1, int y, bool solid)
+{
+    if (y < 0 || y >= l->height)
+        return;
+    if (x0 < 0)
+        x0 = 0;
+    if (x1 > l->width)
+        x1 = l->width;
+    if (x0 >= x1)
+        return;
+
+    const int w0 = x0 / LAND_WORD_BITS;
+    const int w1 = (x1 - 1) / LAND_WORD_BITS;
+    const int row = (y / LAND_TILE_SIZE) * l->tiles_w;
+
+    for (int w = w0; w <= w1; w++)
+    {
+        uint64_t mask = ~(uint64_t)0;
+        if (w == w0)
+            mask &= WORD_MASK_FROM(x0 % LAND_WORD_BITS);
+        if (w == w1)
+            mask &= WORD_MASK_UPTO((x1 - 1) % LAND_WORD_BITS);
+
+        /* Nothing to do in a tile that's already all one way. */
+        if (!l->tiles[row + w] && l->uniform[row + w] == solid)
+            continue;
+
+        uint64_t *word = land_word_ptr(l, w, y);
+        if (solid)
+            *word |= mask;
+        else
+            *word &= ~mask;
+    }
+}
+
+int land_find(const struct land *l, int x, int y, int dir, bool solid)
+{
+    const uint64_t flip = solid ? 0 : ~(uint64_t)0;
+
+    if (dir > 0)
+    {
+        if (x < 0)
+            x = 0;
+        if (y < 0 || y >= l->height || x >= l->width)
+            return l->width;
+
+        int w = x / LAND_WORD_BITS;
+        uint64_t word = (land_word(l, w, y) ^ flip) & WORD_MASK_FROM(x % LAND_WORD_BITS);
+        for (;;)
+        {
+            if (word)
+            {
+                int found = w * LAND_WORD_BITS + LOWEST_BIT(word);
+                return found < l->width ? found : l->width;
+            }
+            if (++w >= l->tiles_w)
+                return l->width;
+            word = land_word(l, w, y) ^ flip;
+        }
+    }
+    else
+    {
+        if (x >= l->width)
+            x = l->width - 1;
+        if (y < 0 || y >= l->height || x < 0)
+            return -1;
+
+        int w = x / LAND_WORD_BITS;
+        uint64_t word = (land_word(l, w, y) ^ flip) & WORD_MASK_UPTO(x % LAND_WORD_BITS);
+        for (;;)
+        {
+            if (word)
+                return w * LAND_WORD_BITS + HIGHEST_BIT(word);
+            if (--w < 0)
+                return -1;
+            word = land_word(l, w, y) ^ flip;
+        }
+    }
+}
+
+/******************************************************************************\
+Column operations.
+\******************************************************************************/
+
+bool land_settle_column(struct land *l, int x, int top, int bot,
+                        int *changed_top, int *changed_bot)
+{
+    if (x < 0 || x >= l->width)
+        return false;
+    if (top < 0)
+        top = 0;
+    if (bot >= l->height)
+        bot = l->height - 1;
+    if (top > bot)
+        return false;
+
+    const int w = x / LAND_WORD_BITS;
+    const uint64_t bit = (uint64_t)1 << (x % LAND_WORD_BITS);
+
+    /* Count what falls and find where it lands. */
+    int count = 0;
+    int first = -1;
+    int floor = top;
+    for (; floor < l->height; floor++)
+    {
+        if (land_word(l, w, floor) & bit)
+        {
+            if (floor > bot)
+                break;
+            if (first < 0)
+                first = floor;
+            count++;
+        }
+    }
+
+    if (count == 0)
+        return false;
+
+    /* Rewrite [first, floor) as empty cells over count solid ones. */
+    int lo = -1;
+    int hi = -1;
+    for (int y = first; y < floor; y++)
+    {
+        bool was = land_word(l, w, y) & bit;
+        bool now = y >= floor - count;
+        if (was == now)
+            continue;
+        if (now)
+            *land_word_ptr(l, w, y) |= bit;
+        else
+            *land_word_ptr(l, w, y) &= ~bit;
+        if (lo < 0)
+            lo = y;
+        hi = y;
+    }
+
+    if (lo < 0)
+        return false;
+
+    *changed_top = lo;
+    *changed_bot = hi;
+    return true;
+}
+
+/******************************************************************************\
+Pouring liquid.
+\******************************************************************************/
+
+static bool pour_queued(struct land_pour *p, int x, int y)
+{
+    return land_solid_at(&p->queued, x, y);
+}
+
+static void pour_push(struct land_pour *p, const struct land *l, int x, int y)
+{
+    if (x < 0 || x >= l->width || y < 0 || y >= l->height)
+        return;
+    if (land_solid_at(l, x, y) || pour_queued(p, x, y))
+        return;
+
+    if (p->num_cells == p->max_cells)
+    {
+        p->max_cells = p->max_cells ? p->max_cells * 2 : 1024;
+        p->cells = safe_realloc(p->cells, p->max_cells * sizeof *p->cells);
+    }
+
+    int i = p->num_cells++;
+    p->cells[i].x = x;
+    p->cells[i].next = -1;
+    if (p->head[y] < 0)
+        p->head[y] = i;
+    else
+        p->cells[p->tail[y]].next = i;
+    p->tail[y] = i;
+
+    land_set(&p->queued, x, y, 1);
+    if (y > p->deepest)
+        p->deepest = y;
+}
+
+void land_pour_begin(struct land_pour *p, const struct land *l, int x, int y, int n)
+{
+    x = CLAMP(0, l->width - 1, x);
+    y = CLAMP(0, l->height - 1, y);
+
+    /* Poured into the land, it comes out of the nearest free neighbour, below
+     * first. With none free it's lost. */
+    static const int dx[] = { 0, -1, 1, 0, -1, 1, -1, 1 };
+    static const int dy[] = { 1, 0, 0, -1, 1, 1, -1, -1 };
+    for (int i = 0; i < 8 && land_solid_at(l, x, y); i++)
+    {
+        if (land_get(l, x + dx[i], y + dy[i]) == 0)
+        {
+            x += dx[i];
+            y += dy[i];
+        }
+    }
+
+    p->left = n;
+    p->deepest = -1;
+    p->head = safe_malloc(l->height * sizeof *p->head);
+    p->tail = safe_malloc(l->height * sizeof *p->tail);
+    for (int i = 0; i < l->height; i++)
+        p->head[i] = -1;
+    p->cells = NULL;
+    p->num_cells = p->max_cells = 0;
+    land_init(&p->queued, l->width, l->height);
+    pour_push(p, l, x, y);
+}
+
+bool land_pour_step(struct land_pour *p, struct land *l, int max,
+                    struct land_rect *filled)
+{
+    int minx = l->width, miny = l->height;
+    int maxx = -1, maxy = -1;
+
+    while (p->left > 0 && max > 0)
+    {
+        while (p->deepest >= 0 && p->head[p->deepest] < 0)
+            p->deepest--;
+        if (p->deepest < 0)
+        {
+            /* Nowhere left for it to go. */
+            p->left = 0;
+            break;
+        }
+
+        int y = p->deepest;
+        int i = p->head[y];
+        int x = p->cells[i].x;
+        p->head[y] = p->cells[i].next;
+
+        /* Filled by something else since it was queued. */
+        if (land_solid_at(l, x, y))
+        {
+            land_set(&p->queued, x, y, 0);
+            continue;
+        }
+
+        if (y + 1 < l->height && !land_solid_at(l, x, y + 1))
+        {
+            /* Nothing underneath, it falls. The cell can be queued again
+             * once the liquid below rises back up to it. */
+            land_set(&p->queued, x, y, 0);
+            while (y + 1 < l->height && !land_solid_at(l, x, y + 1))
+                y++;
+            if (pour_queued(p, x, y))
+                continue;
+        }
+
+        land_set(l, x, y, 1);
+        p->left--;
+        max--;
+
+        minx = MIN(minx, x);
+        maxx = MAX(maxx, x);
+        miny = MIN(miny, y);
+        maxy = MAX(maxy, y);
+
+        pour_push(p, l, x - 1, y);
+        pour_push(p, l, x + 1, y);
+        pour_push(p, l, x, y - 1);
+    }
+
+    filled->x = minx;
+    filled->y = miny;
+    filled->w = maxx - minx + 1;
+    filled->h = maxy - miny + 1;
+    return p->left <= 0;
+}
+
+void land_pour_end(struct land_pour *p)
+{
+    free(p->head);
+    free(p->tail);
+    free(p->cells);
+    land_free(&p->queued);
+    p->head = p->tail = NULL;
+    p->cells = NULL;
+}
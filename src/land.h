@@ -0,0 +1,167 @@
+#ifndef LAND_H
+#define LAND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEFAULT_LAND_WIDTH  800
+#define DEFAULT_LAND_HEIGHT 600
+#define MIN_LAND_WIDTH      128
+#define MIN_LAND_HEIGHT     128
+#define MAX_LAND_WIDTH      8192
+#define MAX_LAND_HEIGHT     4096
+
+/* Land is stored in square tiles of solid bits, one 64-bit word per row of a
+ * tile, the lowest bit being the leftmost pixel. A tile that's all solid or
+ * all empty isn't allocated, only its value is kept, so memory grows with how
+ * much detail the map has rather than with its size. Bits past the edges of
+ * the map are never read.
+ * Cells read as 0 (empty) or 1 (solid), and -1 outside the map.
+ */
+#define LAND_WORD_BITS  64
+#define LAND_TILE_SIZE  LAND_WORD_BITS
+
+struct land_tile
+{
+    uint64_t rows[LAND_TILE_SIZE];
+};
+
+struct land
+{
+    int width, height;
+    int tiles_w, tiles_h;
+    /* NULL where a tile is uniform, uniform then holds whether it's solid. */
+    struct land_tile **tiles;
+    uint8_t *uniform;
+
+    /* Hash of each tile's content, and of them all. Tiles written to since
+     * land_hash() was last called are listed in stale, so keeping the hash
+     * up to date costs as much as the land that changed. */
+    uint64_t *tile_hash;
+    uint64_t hash;
+    uint8_t *is_stale;
+    int *stale;
+    int num_stale;
+};
+
+/* A rectangle of land in map coordinates. */
+struct land_rect
+{
+    int x, y;
+    int w, h;
+};
+
+static inline bool land_size_valid(int width, int height)
+{
+    return width >= MIN_LAND_WIDTH && width <= MAX_LAND_WIDTH &&
+           height >= MIN_LAND_HEIGHT && height <= MAX_LAND_HEIGHT;
+}
+
+/* Sets up an empty map, the size must be valid. */
+void land_init(struct land *l, int width, int height);
+void land_free(struct land *l);
+
+/* Hash of what the land holds, the same for equal land whichever tiles are
+ * allocated. */
+uint64_t land_hash(struct land *l);
+
+static inline void land_touch_tile(struct land *l, int tile)
+{
+    if (l->is_stale[tile])
+        return;
+    l->is_stale[tile] = 1;
+    l->stale[l->num_stale++] = tile;
+}
+
+/* Frees the tiles overlapping a rectangle that have become uniform. */
+void land_compact(struct land *l, int x, int y, int w, int h);
+
+/* Allocates a uniform tile so it can be modified. */
+struct land_tile *land_split_tile(struct land *l, int tile);
+
+/* Sets [x0, x1) of row y to solid or empty, clipped to the map. */
+void land_fill_span(struct land *l, int x0, int x1, int y, bool solid);
+
+/* Scans row y from x in direction dir (1 or -1) for the first cell that is
+ * solid (or empty). Returns -1 or the map width if there is none.
+ */
+int land_find(const struct land *l, int x, int y, int dir, bool solid);
+
+/* Lets the solid cells in rows [top, bot] of column x fall, in one pass, onto
+ * the first solid cell below bot or the bottom of the map. Returns false if
+ * nothing changed, otherwise the rows [*changed_top, *changed_bot] bound the
+ * cells that did.
+ */
+bool land_settle_column(struct land *l, int x, int top, int bot,
+                        int *changed_top, int *changed_bot);
+
+/* Liquid poured at a point, filling the deepest reachable empty cells first.
+ * Cells waiting to be filled are queued per row, so each poured cell costs a
+ * constant amount of work plus the height it falls.
+ */
+struct land_pour
+{
+    int left;               /* cells still to pour */
+    int deepest;            /* lowest row that may have queued cells */
+    int *head, *tail;       /* per row FIFO of queued cells, -1 if empty */
+    struct land_pour_cell
+    {
+        int x;
+        int next;
+    } *cells;
+    int num_cells, max_cells;
+    struct land queued;     /* cells that are waiting in a row's FIFO */
+};
+
+void land_pour_begin(struct land_pour *p, const struct land *l, int x, int y, int n);
+/* Pours at most max cells, setting filled to the rectangle of cells this step
+ * filled (empty if none). Returns true once the pour is done.
+ */
+bool land_pour_step(struct land_pour *p, struct land *l, int max,
+                    struct land_rect *filled);
+void land_pour_end(struct land_pour *p);
+
+static inline int land_tile_at(const struct land *l, int x, int y)
+{
+    return (y / LAND_TILE_SIZE) * l->tiles_w + x / LAND_TILE_SIZE;
+}
+
+static inline bool land_solid_at(const struct land *l, int x, int y)
+{
+    const struct land_tile *t = l->tiles[land_tile_at(l, x, y)];
+    if (!t)
+        return l->uniform[land_tile_at(l, x, y)];
+    return (t->rows[y % LAND_TILE_SIZE] >> (x % LAND_TILE_SIZE)) & 1;
+}
+
+static inline char land_get(const struct land *l, int x, int y)
+{
+    if (x < 0 || x >= l->width || y < 0 || y >= l->height)
+        return -1;
+    return land_solid_at(l, x, y);
+}
+
+static inline void land_set(struct land *l, int x, int y, char to)
+{
+    if (x < 0 || x >= l->width || y < 0 || y >= l->height)
+        return;
+
+    const int i = land_tile_at(l, x, y);
+    struct land_tile *t = l->tiles[i];
+    if (!t)
+    {
+        if (l->uniform[i] == (to != 0))
+            return;
+        t = land_split_tile(l, i);
+    }
+    land_touch_tile(l, i);
+
+    const uint64_t bit = (uint64_t)1 << (x % LAND_TILE_SIZE);
+    if (to)
+        t->rows[y % LAND_TILE_SIZE] |= bit;
+    else
+        t->rows[y % LAND_TILE_SIZE] &= ~bit;
+}
+
+#endif
@@ -28,4 +28,28 @@ do { fprintf(stderr, "! "); fprintf(stderr, __VA_ARGS__); } while (0)
 uint8_t *rlencode(const uint8_t *src, size_t len, size_t *outlen);
 uint8_t *rldecode(const uint8_t *src, size_t len, size_t *outlen);
 
+/* streaming run length encoder, writes to dst or only counts if dst is NULL
+ */
+struct rlencoder
+{
+	uint8_t *dst;
+	size_t pos;
+	uint8_t c;
+	size_t run;
+};
+
+void rlencode_begin(struct rlencoder *enc, uint8_t *dst);
+void rlencode_flush(struct rlencoder *enc);
+size_t rlencode_end(struct rlencoder *enc);
+
+/* append n repetitions of c
+ */
+static inline void rlencode_put(struct rlencoder *enc, uint8_t c, size_t n)
+{
+	if (enc->run && c != enc->c)
+		rlencode_flush(enc);
+	enc->c = c;
+	enc->run += n;
+}
+
 #endif
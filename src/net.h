@@ -0,0 +1,81 @@
+
+#ifndef NET_H
+#define NET_H
+
+#include <enet/enet.h>
+
+#include "common.h"
+
+/******************************************************************************\
+Networking.
+\******************************************************************************/
+
+#define PORT            8080
+#define CONNECT_TIMEOUT 10000
+
+/* ENet channels, one for each kind of traffic, so a reliable packet being
+ * sent again only holds up packets of its own kind. */
+enum
+{
+    /* RELIABLE, the map size followed by the land, or for lockstep clients
+     * the game followed by the inputs that step it. */
+    CHANNEL_WORLD,
+    /* RELIABLE, entities appearing and disappearing, and bullets fired or
+     * knocked off course. */
+    CHANNEL_EVENTS,
+    /* UNRELIABLE only, snapshots, inputs and their acknowledgements, which
+     * must never wait for a reliable packet. */
+    CHANNEL_STATE,
+    /* RELIABLE, chat, names and notices. */
+    CHANNEL_CHAT,
+    NUM_CHANNELS
+};
+
+void init_enet_client(const char *ip, unsigned port);
+void init_enet_server(unsigned port);
+void uninit_enet(void);
+
+ENetHost *get_client_host(void);
+ENetHost *get_server_host(void);
+ENetPeer *get_peer(void);
+
+/* Packets are serialized in place: create one of the final size, write the
+ * fields straight into packet->data and hand it to one of the send functions,
+ * which take ownership of it.
+ */
+static inline ENetPacket *create_packet(size_t len, bool reliable)
+{
+    ENetPacket *packet = enet_packet_create(NULL, len, reliable ? ENET_PACKET_FLAG_RELIABLE : 0);
+    if (!packet)
+        DIE("Failed to create a packet of %zu bytes.\n", len);
+    return packet;
+}
+
+/* Client -> Server */
+static inline void send_packet(int channel, ENetPacket *packet)
+{
+    enet_peer_send(get_peer(), channel, packet);
+}
+
+/* Server -> Clients */
+static inline void broadcast_packet(int channel, ENetPacket *packet)
+{
+    enet_host_broadcast(get_server_host(), channel, packet);
+}
+
+/* Server -> Client, or every client if peer is NULL. */
+static inline void send_packet_to(ENetPeer *peer, int channel, ENetPacket *packet)
+{
+    if (peer)
+        enet_peer_send(peer, channel, packet);
+    else
+        broadcast_packet(channel, packet);
+}
+
+/* Decodes a received packet, see decode_chunk(). */
+static inline bool receive_chunk(ENetPacket *packet, struct chunk *chunk)
+{
+    return decode_chunk(packet->data, packet->dataLength, chunk);
+}
+
+#endif
@@ -0,0 +1,220 @@
+
+#include "game.h"
+
+/* A replay being played back, see REPLAY_MAGIC. The next record is read
+ * ahead so playing can stop before frames it hasn't reached.
+ */
+struct replay
+{
+    FILE *file;
+    long start;
+    int tick_ms;
+
+    uint8_t *buf;
+    size_t buf_max;
+    bool pending;
+    uint32_t frame;
+    struct chunk chunk;
+
+    bool trace;
+    long mismatches;
+};
+
+/* Reads the next record into r->frame and r->chunk, false at the end of the
+ * replay or if it's malformed. */
+static bool read_record(struct replay *r)
+{
+    uint8_t header[REPLAY_RECORD_HEADER_SIZE];
+    if (fread(header, sizeof header, 1, r->file) != 1)
+        return false;
+
+    size_t pos = 0;
+    r->frame = read32(header, &pos);
+    size_t len = read32(header, &pos);
+    if (len > r->buf_max)
+    {
+        r->buf_max = len;
+        r->buf = safe_realloc(r->buf, len);
+    }
+
+    if (fread(r->buf, len, 1, r->file) != 1 || !decode_chunk(r->buf, len, &r->chunk))
+    {
+        ERR("Replay is cut off or malformed at frame %u.\n", (unsigned)r->frame);
+        return false;
+    }
+    return true;
+}
+
+static void apply_bundle(struct replay *r, struct moag *m, struct input_bundle_chunk *bundle)
+{
+    size_t pos = 0;
+    struct input_bundle_entry e;
+    while (pos < bundle->len)
+    {
+        read_bundle_entry(bundle, &pos, &e);
+        if (e.id >= MAX_PLAYERS)
+            continue;
+        if (e.type == BUNDLE_INPUT)
+            game_input(m, e.id, e.key, e.ms);
+        else if (e.type == BUNDLE_JOIN)
+            game_join(m, e.id);
+        else
+            game_leave(m, e.id);
+    }
+
+    if (bundle->checksum && game_checksum(m) != bundle->checksum)
+    {
+        if (!r->mismatches)
+            ERR("Replay went differently from frame %u.\n", (unsigned)bundle->frame);
+        r->mismatches++;
+    }
+}
+
+static void apply_record(struct replay *r, struct moag *m)
+{
+    struct chunk *chunk = &r->chunk;
+    if (chunk->type == INPUT_BUNDLE_CHUNK)
+    {
+        apply_bundle(r, m, &chunk->input_bundle);
+    }
+    else if (chunk->type == SERVER_MSG_CHUNK && chunk->server_msg.action == NAME_CHANGE &&
+             chunk->server_msg.id < MAX_PLAYERS)
+    {
+        char *name = m->players[chunk->server_msg.id].name;
+        size_t len = MIN(chunk->server_msg.len, MAX_NAME_LEN - 1);
+        memcpy(name, chunk->server_msg.data, len);
+        name[len] = '\0';
+    }
+}
+
+static void step(struct replay *r, struct moag *m)
+{
+    uint64_t start = monotonic_us();
+    step_game(m);
+    if (r->trace)
+        printf("%d %llu\n", m->frame, (unsigned long long)(monotonic_us() - start));
+    clear_game_events(m);
+    clear_land_dirty(m);
+}
+
+/* Starts the game over from the state the replay begins with. */
+static bool restart_replay(struct replay *r, struct moag *m)
+{
+    fseek(r->file, r->start, SEEK_SET);
+    r->pending = false;
+    r->mismatches = 0;
+
+    if (!read_record(r) || r->chunk.type != GAME_STATE_CHUNK ||
+        !read_game_state(m, r->chunk.game_state.data, r->chunk.game_state.len))
+    {
+        ERR("Replay doesn't start with a game.\n");
+        return false;
+    }
+    return true;
+}
+
+/* Applies the records for frames before frame, stepping the game up to each. */
+static void play_records(struct replay *r, struct moag *m, uint32_t frame)
+{
+    for (;;)
+    {
+        if (!r->pending)
+            r->pending = read_record(r);
+        if (!r->pending || r->frame >= frame)
+            return;
+
+        while ((uint32_t)m->frame < r->frame)
+            step(r, m);
+        apply_record(r, m);
+        r->pending = false;
+    }
+}
+
+/* Plays the replay until the game is about to step frame, going back to the
+ * start first if it's already past it. Frames past the end of the replay are
+ * stepped without input. Returns false if the replay can't be played.
+ */
+static bool seek_replay(struct replay *r, struct moag *m, uint32_t frame)
+{
+    if ((uint32_t)m->frame > frame && !restart_replay(r, m))
+        return false;
+
+    play_records(r, m, frame);
+    while ((uint32_t)m->frame < frame)
+        step(r, m);
+    return true;
+}
+
+static int usage(const char *name)
+{
+    printf("usage:  %s [-f play until frame] "
+           "[-t print how long each frame took in us] replay\n", name);
+    return EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[])
+{
+    struct replay r;
+    memset(&r, 0, sizeof r);
+    long frame = -1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:t")) != -1)
+    {
+        switch (opt)
+        {
+            case 'f':
+                frame = atol(optarg);
+                if (frame >= 0)
+                    break;
+                printf("Frame can't be negative.\n");
+                return EXIT_FAILURE;
+
+            case 't':
+                r.trace = true;
+                break;
+
+            default:
+                return usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1)
+        return usage(argv[0]);
+
+    r.file = fopen(argv[optind], "rb");
+    if (!r.file)
+        DIE("Can't open %s.\n", argv[optind]);
+
+    uint8_t header[REPLAY_HEADER_SIZE];
+    size_t pos = 4;
+    if (fread(header, sizeof header, 1, r.file) != 1 ||
+        memcmp(header, REPLAY_MAGIC, 4) != 0 || read8(header, &pos) != REPLAY_VERSION)
+        DIE("%s isn't a replay this version can play.\n", argv[optind]);
+    r.tick_ms = read8(header, &pos);
+    r.start = ftell(r.file);
+
+    struct moag moag;
+    memset(&moag, 0, sizeof moag);
+    land_init(&moag.land, DEFAULT_LAND_WIDTH, DEFAULT_LAND_HEIGHT);
+    if (!restart_replay(&r, &moag))
+        return EXIT_FAILURE;
+
+    uint32_t start_frame = moag.frame;
+    uint64_t start = monotonic_us();
+    if (frame >= 0)
+        seek_replay(&r, &moag, frame);
+    else
+        play_records(&r, &moag, UINT32_MAX);
+    double secs = (monotonic_us() - start) / 1000000.0;
+
+    int frames = moag.frame - start_frame;
+    fprintf(r.trace ? stderr : stdout,
+            "Played frames %u to %d, %.1f s of game, in %.3f s (%.0f frames a second). "
+            "Checksum %08x, %ld mismatches.\n",
+            (unsigned)start_frame, moag.frame, frames * r.tick_ms / 1000.0, secs,
+            secs > 0 ? frames / secs : 0.0, (unsigned)game_checksum(&moag), r.mismatches);
+
+    fclose(r.file);
+    return r.mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
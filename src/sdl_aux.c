@@ -30,6 +30,12 @@ void init_sdl(unsigned w, unsigned h, const char *title)
     SDL_WM_SetCaption(title, NULL);
 }
 
+void resize_window(unsigned w, unsigned h)
+{
+    if (!SDL_SetVideoMode(w, h, 32, SDL_DOUBLEBUF))
+        die("%s\n", SDL_GetError());
+}
+
 void uninit_sdl(void)
 {
     TTF_Quit();
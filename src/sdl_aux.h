@@ -260,6 +260,7 @@ static inline void draw_block(int x, int y, int w, int h, color_type color)
 }
 
 void init_sdl(unsigned w, unsigned h, const char *title);
+void resize_window(unsigned w, unsigned h);
 void uninit_sdl(void);
 
 void grab_events(void);
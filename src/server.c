@@ -1,871 +1,615 @@
 
+#include <errno.h>
+#include <signal.h>
+#include <zlib.h>
+
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
+
 #include "server.h"
 
-void set_timer(struct moag *m, int frame, char type, float x, float y, float vx, float vy)
-{
-    int i = 0;
-    while (m->timers[i].frame)
-        if (++i >= MAX_TIMERS)
-            return;
-    m->timers[i].frame = frame;
-    m->timers[i].type = type;
-    m->timers[i].x = x;
-    m->timers[i].y = y;
-    m->timers[i].vx = vx;
-    m->timers[i].vy = vy;
-}
+struct client clients[MAX_CLIENTS];
+
+/* The snapshots clients may have, and the sequence number of the newest. */
+static struct snapshot_state snapshots[SNAPSHOT_HISTORY];
+static uint16_t snapshot_seq = 0;
+
+/* Whether clients have been told about a bullet, and whether they need telling
+ * again at the end of the tick because it was fired or knocked off its flight.
+ */
+static bool bullet_known[MAX_BULLETS];
+static bool bullet_changed[MAX_BULLETS];
+
+/* Lockstep servers send clients what happens to the game instead of what it
+ * looks like, and clients step it themselves. */
+static bool lockstep = false;
+
+/* Time between ticks, and the fewest and most ticks between snapshots. */
+static int tick_ms = DEFAULT_TICK_MS;
+static int min_snapshot_interval = 1;
+static int max_snapshot_interval = 1;
+
+/* How ticks have kept to time since the last report. */
+static int ticks_run = 0, ticks_caught_up = 0, ticks_dropped = 0;
+static uint64_t total_late_us = 0, max_late_us = 0;
+
+/* Where the game is recorded to, if anywhere. */
+static FILE *replay = NULL;
 
-void kill_tank(struct moag *m, int id)
+/* Where the game is checkpointed to, if anywhere, the frame the next
+ * checkpoint is due, and the process writing the last one. */
+static const char *checkpoint_path = NULL;
+static int next_checkpoint = 0;
+#ifndef WIN32
+static pid_t checkpoint_pid = 0;
+#endif
+
+/* Players restored from a checkpoint that nobody has reconnected to by this
+ * frame leave. */
+static int resume_until = 0;
+
+/* Set by a signal to stop the server once the tick is over. */
+static volatile sig_atomic_t stopping = 0;
+
+/* Everything applied to the game since the last frame, for lockstep clients
+ * and the replay. */
+static struct input_bundle_entry *bundle = NULL;
+static int bundle_len = 0, bundle_max = 0;
+
+static void record_bundle_entry(int type, int id, int key, uint16_t ms)
 {
-    m->players[id].tank.x = -30;
-    m->players[id].tank.y = -30;
-    m->players[id].spawn_timer = RESPAWN_TIME;
-    broadcast_tank_chunk(m, KILL, id);
+    if (!lockstep && !replay)
+        return;
+
+    if (bundle_len == bundle_max)
+    {
+        bundle_max = bundle_max ? bundle_max * 2 : 64;
+        bundle = safe_realloc(bundle, bundle_max * sizeof *bundle);
+    }
+    bundle[bundle_len].type = type;
+    bundle[bundle_len].id = id;
+    bundle[bundle_len].key = key;
+    bundle[bundle_len].ms = ms;
+    bundle_len++;
 }
 
-void explode(struct moag *m, int x, int y, int rad, char type)
+/* Appends a chunk to the replay, as applied before the coming frame. A replay
+ * that can't be written is stopped rather than left with a gap. */
+static void record_chunk(struct moag *m, ENetPacket *packet)
 {
-    if (type == E_COLLAPSE)
-    {
-        for (int iy = -rad; iy <= rad; iy++)
-            for (int ix = -rad; ix <= rad; ix++)
-                if (SQ(ix) + SQ(iy) < SQ(rad) && get_land_at(m, x+ix, y+iy))
-                    set_land_at(m, x + ix, y + iy, 2);
-        int maxy = y + rad;
-        for (int iy = -rad; iy <= rad; iy++)
-        {
-            for (int ix = -rad; ix <= rad; ix++)
-            {
-                if (get_land_at(m, x + ix, y + iy) == 2)
-                {
-                    int count = 0;
-                    int yy;
-                    for (yy = y + iy;
-                         yy < LAND_HEIGHT && get_land_at(m, x + ix, yy) != 1;
-                         yy++)
-                    {
-                        if (get_land_at(m, x + ix, yy) == 2)
-                        {
-                            count++;
-                            set_land_at(m, x + ix, yy, 0);
-                        }
-                    }
-                    for (; count > 0; count--)
-                        set_land_at(m, x + ix, yy - count, 1);
-                    if (yy > maxy)
-                        maxy = yy;
-                }
-            }
-        }
-        broadcast_packed_land_chunk(m, x - rad, y - rad, rad * 2, maxy - (y - rad));
-        return;
+    uint8_t header[REPLAY_RECORD_HEADER_SIZE];
+    size_t pos = 0;
+    write32(header, &pos, m->frame);
+    write32(header, &pos, packet->dataLength);
+
+    if (fwrite(header, pos, 1, replay) != 1 ||
+        fwrite(packet->data, packet->dataLength, 1, replay) != 1)
+    {
+        ERR("Failed to write the replay, stopping it.\n");
+        fclose(replay);
+        replay = NULL;
     }
-    char p = type == E_DIRT ? 1 : 0;
-    for (int iy = -rad; iy <= rad; iy++)
-        for (int ix = -rad; ix <= rad; ix++)
-            if (SQ(ix) + SQ(iy) < SQ(rad))
-                set_land_at(m, x + ix, y + iy, p);
-    if (type == E_EXPLODE)
-        for (int i = 0; i < MAX_PLAYERS; i++)
-            if (m->players[i].connected &&
-                SQ(m->players[i].tank.x - x) + SQ(m->players[i].tank.y - 3 - y) < SQ(rad + 4))
-                kill_tank(m, i);
-
-    broadcast_packed_land_chunk(m, x - rad, y - rad, rad * 2, rad * 2);
 }
 
-void spawn_tank(struct moag *m, int id)
+/* Records the game as it is now, which the replay goes on from. */
+void start_replay(struct moag *m)
 {
-    m->players[id].connected = true;
-    m->players[id].spawn_timer = 0;
-    m->players[id].ladder_timer = LADDER_TIME;
-    m->players[id].ladder_count = 3;
-    m->players[id].kleft = false;
-    m->players[id].kright = false;
-    m->players[id].kup = false;
-    m->players[id].kdown = false;
-    m->players[id].kfire = false;
-    m->players[id].tank.x = rng_range(&m->rng, 20, LAND_WIDTH - 20);
-    m->players[id].tank.y = 60;
-    m->players[id].tank.obj.pos = VEC2(m->players[id].tank.x, m->players[id].tank.y);
-    m->players[id].tank.obj.vel = VEC2(0, 0);
-    m->players[id].tank.angle = 35;
-    m->players[id].tank.facingleft = 0;
-    m->players[id].tank.power = 0;
-    m->players[id].tank.bullet = MISSILE;
-    m->players[id].tank.num_burst = 1;
-    explode(m, m->players[id].tank.x, m->players[id].tank.y - 12, 12, E_SAFE_EXPLODE);
-    broadcast_tank_chunk(m, SPAWN, id);
+    uint8_t header[REPLAY_HEADER_SIZE];
+    size_t pos = 0;
+    write_bytes(header, &pos, REPLAY_MAGIC, 4);
+    write8(header, &pos, REPLAY_VERSION);
+    write8(header, &pos, tick_ms);
+    if (fwrite(header, pos, 1, replay) != 1)
+        DIE("Failed to write the replay.\n");
+
+    ENetPacket *packet = create_game_state_chunk(m);
+    record_chunk(m, packet);
+    enet_packet_destroy(packet);
 }
 
-void spawn_client(struct moag *m, int id)
+/* Sends what was applied to the game before this frame, checked every so
+ * often so clients that went out of sync find out, and records it. Only
+ * frames with something in them are recorded, written out straight away so
+ * the replay survives the server going down. */
+void send_input_bundle(struct moag *m)
 {
-    sprintf(m->players[id].name,"p%d",id);
-    char notice[64] = "  ";
-    strcat(notice, m->players[id].name);
-    strcat(notice, " has connected");
-    broadcast_chat(-1, SERVER_NOTICE, notice, strlen(notice) + 1);
+    int checksum_frames = lockstep ? LOCKSTEP_CHECKSUM_FRAMES : REPLAY_CHECKSUM_FRAMES;
+    uint32_t checksum = m->frame % checksum_frames ? 0 : game_checksum(m);
+    ENetPacket *packet = create_input_bundle_chunk(m->frame, checksum, bundle, bundle_len);
 
-    spawn_tank(m, id);
-    broadcast_packed_land_chunk(m, 0, 0, LAND_WIDTH, LAND_HEIGHT);
-    broadcast_chat(id, NAME_CHANGE,m->players[id].name, strlen(m->players[id].name) + 1);
-    if (m->crate.active)
-        broadcast_crate_chunk(m, SPAWN);
+    if (replay && (bundle_len || checksum))
+    {
+        record_chunk(m, packet);
+        if (replay)
+            fflush(replay);
+    }
 
-    for (int i = 0; i < MAX_PLAYERS; ++i)
+    if (lockstep)
+        broadcast_packet(CHANNEL_WORLD, packet);
+    else
+        enet_packet_destroy(packet);
+    bundle_len = 0;
+}
+
+/* Sends the land changed this tick, freeing any tiles it left uniform. */
+void flush_land_dirty(struct moag *m)
+{
+    if (!lockstep)
     {
-        if (m->players[i].connected)
+        for (int i = 0; i < m->num_dirty; i++)
         {
-            broadcast_tank_chunk(m, SPAWN, i);
-            broadcast_chat(i, NAME_CHANGE, m->players[i].name, strlen(m->players[i].name) + 1);
+            struct land_rect *r = &m->dirty[i];
+            broadcast_packed_land_chunk(m, r->x, r->y, r->w, r->h);
         }
     }
+    clear_land_dirty(m);
 }
 
-void disconnect_client(struct moag *m, int id)
+static void take_snapshot(struct moag *m, struct snapshot_state *s)
 {
-    m->players[id].connected = 0;
-    broadcast_tank_chunk(m, KILL, id);
+    memset(s, 0, sizeof *s);
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        struct tank *t = &m->players[i].tank;
+        if (!m->players[i].connected)
+            continue;
+        s->tanks[i].present = true;
+        s->tanks[i].x = t->x;
+        s->tanks[i].y = t->y;
+        s->tanks[i].angle = t->facingleft ? -t->angle : t->angle;
+    }
+    if (m->crate.active)
+    {
+        s->crate.present = true;
+        s->crate.x = m->crate.x;
+        s->crate.y = m->crate.y;
+    }
 }
 
-void launch_ladder(struct moag *m, int x, int y)
+/* Ticks between snapshots sent rate times a second. */
+static int snapshot_interval(int rate)
 {
-    int i = 0;
-    while (m->bullets[i].active)
-        if (++i >= MAX_BULLETS)
-            return;
-    m->bullets[i].active = LADDER_LENGTH;
-    m->bullets[i].type = LADDER;
-    m->bullets[i].x = x;
-    m->bullets[i].y = y;
-    m->bullets[i].obj.pos = VEC2(x, y);
-    m->bullets[i].obj.vel = VEC2(0, -1);
-    broadcast_bullet_chunk(m, SPAWN, i);
+    return MAX(1, (1000 / tick_ms + rate / 2) / rate);
 }
 
-void fire_bullet(struct moag *m, char type, float x, float y, float vx, float vy)
+/* Sends snapshots less often to clients that are losing packets or being
+ * throttled, and more often again to those that no longer are. */
+static void adapt_snapshot_interval(struct client *c)
 {
-    int i = 0;
-    while (m->bullets[i].active)
-        if (++i >= MAX_BULLETS)
-            return;
-    m->bullets[i].active = 4;
-    m->bullets[i].type = type;
-    m->bullets[i].obj.pos = VEC2(x, y);
-    m->bullets[i].x = (int)m->bullets[i].obj.pos.x;
-    m->bullets[i].y = (int)m->bullets[i].obj.pos.y;
-    m->bullets[i].obj.vel = VEC2(vx, vy);
-    broadcast_bullet_chunk(m, SPAWN, i);
+    ENetPeer *peer = c->peer;
+    if (peer->packetLoss > SNAPSHOT_SLOW_LOSS ||
+        peer->packetThrottle < ENET_PEER_PACKET_THROTTLE_SCALE / 2)
+        c->snapshot_interval = MIN(c->snapshot_interval + 1, max_snapshot_interval);
+    else if (peer->packetLoss < SNAPSHOT_FAST_LOSS)
+        c->snapshot_interval = MAX(c->snapshot_interval - 1, min_snapshot_interval);
 }
 
-void fire_bullet_ang(struct moag *m, char type, int x, int y, float angle, float vel)
+/* Takes this tick's snapshot and sends it to each client that's due one, as
+ * changes from the newest one it has acknowledged if that's still kept.
+ */
+void send_snapshots(struct moag *m)
 {
-    fire_bullet(m, type, (float)x + 5.0 * cosf(DEG2RAD(angle)),
-                         (float)y - 5.0 * sinf(DEG2RAD(angle)),
-                         vel * cosf(DEG2RAD(angle)),
-                        -vel * sinf(DEG2RAD(angle)));
+    snapshot_seq = next_seq(snapshot_seq);
+
+    struct snapshot_state *now = &snapshots[snapshot_seq % SNAPSHOT_HISTORY];
+    take_snapshot(m, now);
+    now->seq = snapshot_seq;
+    now->tick = m->frame;
+
+    bool adapt = m->frame % MAX(1, SNAPSHOT_ADAPT_MS / tick_ms) == 0;
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        struct client *c = &clients[i];
+        if (!c->peer)
+            continue;
+        if (adapt)
+            adapt_snapshot_interval(c);
+        if (--c->snapshot_wait > 0)
+            continue;
+        c->snapshot_wait = c->snapshot_interval;
+
+        const struct snapshot_state *base = &snapshots[c->acked % SNAPSHOT_HISTORY];
+        if (!c->acked || base->seq != c->acked || base == now)
+            base = NULL;
+        send_snapshot_chunk(c, now, base);
+    }
 }
 
-void liquid(struct moag *m, int x, int y, int n)
+/* Tells clients about the bullets they can't fly to where they are now. */
+void flush_bullets(struct moag *m)
 {
-    if (x < 0)
-        x = 0;
-    if (y < 0)
-        y = 0;
-    if (x >= LAND_WIDTH)
-        x = LAND_WIDTH - 1;
-    if (y >= LAND_HEIGHT)
-        y = LAND_HEIGHT - 1;
-
-    int minx = LAND_WIDTH;
-    int miny = LAND_HEIGHT;
-    int maxx = 0;
-    int maxy = 0;
-    for (int i = 0; i < n; i++)
-    {
-        if (y < 0)
-        {
-            /* hit top of map, try going sideways */
-            y = 0;
-            for (int i = 1; i < LAND_WIDTH; i++)
-            {
-                if (get_land_at(m, x-i, y) == 0)
-                {
-                    x -= i;
-                    break;
-                }
-                if (get_land_at(m, x+i, y) == 0)
-                {
-                    x += i;
-                    break;
-                }
-            }
-            set_land_at(m, x, y, 3);
-
-            if (x < minx)
-                minx = x;
-            else if (x > maxx)
-                maxx = x;
-
-            if (y < miny)
-                miny = y;
-            else if (y > maxy)
-                maxy = y;
-        }
-
-        /* nx keeps track of where to start filling next layer */
-        int nx = x;
-        if (get_land_at(m, x, y + 1) == 0)
-        {
-            y++;
-        }
-        else if (get_land_at(m, x - 1, y) == 0)
-        {
-            x--;
-        }
-        else if (get_land_at(m, x + 1, y) == 0)
-        {
-            x++;
-        }
-        else
-        {
-            /* no space below, left, right */
-            /* try going right, skipping already-filled pixels */
-            for (int i = x; i < LAND_WIDTH + 1; i++)
-            {
-                if (nx == x && get_land_at(m, i, y - 1) == 0)
-                    nx = i;
-                if (get_land_at(m, i, y) == 0)
-                {
-                    x = i;
-                    break;
-                }
-                else if (get_land_at(m, i, y) != 3)
-                {
-                    /* hit a wall */
-                    /* try other direction */
-                    for (int i = x; i >= -1; i--)
-                    {
-                        if (nx == x && get_land_at(m, i, y - 1) == 0)
-                            nx = i;
-                        if (get_land_at(m, i, y) == 0)
-                        {
-                            x = i;
-                            break;
-                        }
-                        else if (get_land_at(m, i, y) != 3)
-                        {
-                            /* hit a wall again, go up */
-                            y--;
-                            x = nx;
-                            break;
-                        }
-                    }
-                    break;
-                }
-            }
-        }
-        set_land_at(m, x, y, 3);
-
-        if (x < minx)
-            minx = x;
-        else if (x > maxx)
-            maxx = x;
-
-        if (y < miny)
-            miny = y;
-        else if (y > maxy)
-            maxy = y;
-    }
-    for (int iy = miny; iy <= maxy; iy++)
-        for (int ix = minx; ix <= maxx; ix++)
-            if (get_land_at(m, ix, iy) == 3)
-                set_land_at(m, ix, iy, 1);
-    broadcast_packed_land_chunk(m, minx, miny, maxx - minx + 1, maxy - miny + 1);
+    for (int j = 0; j < m->num_bullets; j++)
+    {
+        int i = m->live_bullets[j];
+        if (!bullet_changed[i])
+            continue;
+        broadcast_bullet_chunk(m, bullet_known[i] ? MOVE : SPAWN, i, snapshot_seq);
+        bullet_known[i] = true;
+        bullet_changed[i] = false;
+    }
 }
 
-void tank_update(struct moag *m, int id)
+/* Sends lockstep clients that joined or went out of sync the whole game. */
+void send_game_states(struct moag *m)
 {
-    struct tank *t = &m->players[id].tank;
-
-    if (!m->players[id].connected)
-        return;
-
-    if (m->players[id].spawn_timer > 0)
+    for (int i = 0; i < MAX_CLIENTS; i++)
     {
-        if (--m->players[id].spawn_timer <= 0)
-            spawn_tank(m, id);
-        return;
+        struct client *c = &clients[i];
+        if (!c->peer || !c->needs_state)
+            continue;
+        send_game_state_chunk(c->peer, m);
+        c->needs_state = false;
     }
+}
 
-    bool moved = false;
-    bool grav = true;
-    if (m->players[id].ladder_timer >= 0 && (!m->players[id].kleft || !m->players[id].kright))
-        m->players[id].ladder_timer = LADDER_TIME;
-
-    if (m->players[id].kleft && m->players[id].kright)
+/* Tells clients what happened in the game since it was last asked. Lockstep
+ * clients see it all happen themselves. */
+void send_events(struct moag *m)
+{
+    if (lockstep)
     {
-        if (m->players[id].ladder_timer > 0)
-        {
-            if (get_land_at(m, t->x, t->y + 1))
-                m->players[id].ladder_timer--;
-            else
-                m->players[id].ladder_timer = LADDER_TIME;
-        }
-        else if (m->players[id].ladder_timer == 0)
-        {
-            if (m->players[id].ladder_count > 0)
-            {
-                launch_ladder(m, t->x, t->y);
-                m->players[id].ladder_count--;
-            }
-            m->players[id].ladder_timer = LADDER_TIME;
-        }
+        clear_game_events(m);
+        return;
     }
-    else if (m->players[id].kleft)
+
+    for (int i = 0; i < m->num_events; i++)
     {
-        t->facingleft = 1;
-        if (get_land_at(m, t->x - 1, t->y) == 0 && t->x >= 10)
-        {
-            t->x--;
-        }
-        else if (get_land_at(m, t->x - 1, t->y - 1) == 0 && t->x >= 10)
+        struct game_event *ev = &m->events[i];
+        switch (ev->type)
         {
-            t->x--;
-            t->y--;
+            case EVENT_TANK_SPAWNED:
+                broadcast_tank_chunk(m, SPAWN, ev->id);
+                break;
+
+            case EVENT_TANK_KILLED:
+                broadcast_tank_chunk(m, KILL, ev->id);
+                break;
+
+            case EVENT_BULLET_CHANGED:
+                bullet_changed[ev->id] = true;
+                break;
+
+            /* Tells clients a bullet is gone, if they ever heard of it. */
+            case EVENT_BULLET_KILLED:
+                if (bullet_known[ev->id])
+                    broadcast_bullet_chunk(m, KILL, ev->id, snapshot_seq);
+                bullet_known[ev->id] = false;
+                bullet_changed[ev->id] = false;
+                break;
+
+            case EVENT_CRATE_SPAWNED:
+                broadcast_crate_chunk(m, SPAWN);
+                break;
+
+            case EVENT_CRATE_TAKEN:
+                broadcast_crate_chunk(m, KILL);
+                break;
+
+            case EVENT_NOTICE:
+                broadcast_chat(-1, SERVER_NOTICE, ev->notice, strlen(ev->notice) + 1);
+                break;
         }
-        else if (get_land_at(m, t->x, t->y - 1) == 0 ||
-                 get_land_at(m, t->x, t->y - 2) == 0 ||
-                 get_land_at(m, t->x, t->y - 3) == 0)
-        {
-            grav = false;
-            t->y--;
-        }
-        else
-        {
-            grav = false;
-        }
-        moved = true;
-    }
-    else if (m->players[id].kright)
-    {
-        t->facingleft = 0;
-        if (get_land_at(m, t->x + 1, t->y) == 0 && t->x < LAND_WIDTH - 10)
-        {
-            t->x++;
-        }
-        else if (get_land_at(m, t->x + 1, t->y - 1) == 0 &&
-                 t->x < LAND_WIDTH - 10)
-        {
-            t->x++;
-            t->y--;
-        }
-        else if (get_land_at(m, t->x, t->y - 1) == 0 ||
-                 get_land_at(m, t->x, t->y - 2) == 0 ||
-                 get_land_at(m, t->x, t->y - 3) == 0)
-        {
-            grav = false;
-            t->y--;
-        }
-        else
-        {
-            grav = false;
-        }
-        moved = true;
     }
+    clear_game_events(m);
+}
 
-    // Physics
-    if (t->y < 20)
-    {
-        t->y = 20;
-        moved = true;
-    }
+/* Counts the tick against each client's newest input. */
+static void age_inputs(void)
+{
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        if (clients[i].input_ticks < UINT16_MAX)
+            clients[i].input_ticks++;
+}
 
-    if (grav)
-    {
-        if (get_land_at(m, t->x, t->y + 1) == 0)
-        {
-            t->y++;
-            moved = true;
-        }
-        if (get_land_at(m, t->x, t->y + 1) == 0)
-        {
-            t->y++;
-            moved = true;
-        }
-    }
+/* Writes the game to path, to a temporary file first so a crash never leaves
+ * half a checkpoint in its place. */
+static bool write_checkpoint(struct moag *m, const char *path)
+{
+    size_t len = write_game_state(m, NULL);
+    uint8_t *state = safe_malloc(len);
+    write_game_state(m, state);
+
+    uLongf packed_len = compressBound(len);
+    uint8_t *buf = safe_malloc(CHECKPOINT_HEADER_SIZE + packed_len);
+    size_t pos = 0;
+    write_bytes(buf, &pos, CHECKPOINT_MAGIC, 4);
+    write8(buf, &pos, CHECKPOINT_VERSION);
+    write32(buf, &pos, len);
+    for (int i = 0; i < MAX_PLAYERS; i++)
+        write32(buf, &pos, clients[i].host);
+    bool ok = compress(buf + pos, &packed_len, state, len) == Z_OK;
+    free(state);
+
+    char tmp[FILENAME_MAX];
+    snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    FILE *f = ok ? fopen(tmp, "wb") : NULL;
+    ok = f && fwrite(buf, pos + packed_len, 1, f) == 1;
+    ok = f && fclose(f) == 0 && ok;
+    free(buf);
+#ifdef WIN32
+    remove(path);
+#endif
+    ok = ok && rename(tmp, path) == 0;
+
+    if (!ok)
+        ERR("Failed to write a checkpoint to %s.\n", path);
+    return ok;
+}
 
-    if (abs(t->x - m->crate.x) < 14 && abs(t->y - m->crate.y) < 14)
-    {
-        m->players[id].ladder_timer = LADDER_TIME;
-        if (m->crate.type == TRIPLER)
-            t->num_burst *= 3;
-        else
-            t->bullet = m->crate.type;
-        m->crate.active = false;
-        broadcast_crate_chunk(m, KILL);
-        char notice[64] = "* ";
-        strcat(notice, m->players[id].name);
-        strcat(notice, " got ");
-        switch (m->crate.type)
-        {
-            case  0: strcat(notice, "Missile"); break;
-            case  1: strcat(notice, "Baby Nuke"); break;
-            case  2: strcat(notice, "Nuke"); break;
-            case  3: strcat(notice, "Dirtball"); break;
-            case  4: strcat(notice, "Super Dirtball"); break;
-            case  5: strcat(notice, "Collapse"); break;
-            case  6: strcat(notice, "Liquid Dirt"); break;
-            case  7: strcat(notice, "Bouncer"); break;
-            case  8: strcat(notice, "Tunneler"); break;
-            case 10: strcat(notice, "MIRV"); break;
-            case 12: strcat(notice, "Cluster Bomb"); break;
-            case 13: strcat(notice, "Cluster Bouncer"); break;
-            case 14: strcat(notice, "Shotgun"); break;
-            case 16: strcat(notice, "*Triple*"); break;
-            default: strcat(notice, "???"); ERR("BTYPE: %d\n", m->crate.type); break;
-        }
-        broadcast_chat(-1, SERVER_NOTICE, notice, strlen(notice) + 1);
-    }
+/* Writes a checkpoint from a copy of the process, so the tick isn't held up,
+ * or in place if there's no forking or wait is set. Returns false if now isn't
+ * the time, terrain jobs can't be saved halfway or the last checkpoint is
+ * still being written.
+ */
+bool save_checkpoint(struct moag *m, bool wait)
+{
+    if (m->num_jobs)
+        return false;
 
-    // Aim
-    if (m->players[id].kup && t->angle < 90)
+#ifndef WIN32
+    if (checkpoint_pid > 0)
     {
-        t->angle++;
-        moved = true;
-    }
-    else if (m->players[id].kdown && t->angle > 1)
-    {
-        t->angle--;
-        moved = true;
+        if (waitpid(checkpoint_pid, NULL, wait ? 0 : WNOHANG) == 0)
+            return false;
+        checkpoint_pid = 0;
     }
 
-    // Fire
-    if (t->power)
+    if (!wait)
     {
-        float burst_spread = 4.0;
-        if (t->bullet == SHOTGUN)
+        pid_t pid = fork();
+        if (pid == 0)
+            _exit(write_checkpoint(m, checkpoint_path) ? EXIT_SUCCESS : EXIT_FAILURE);
+        if (pid > 0)
         {
-            t->num_burst *= SHOTGUN_PELLETS;
-            burst_spread = 2.0;
+            checkpoint_pid = pid;
+            return true;
         }
-        int num_burst = t->bullet == MISSILE ? 1 : t->num_burst;
-        float start_angle = t->facingleft ? 180 - t->angle : t->angle;
-        start_angle -= (num_burst-1)*burst_spread/2.0;
-        for (int i = 0; i < num_burst; i++)
-        {
-            fire_bullet_ang(m, t->bullet, t->x, t->y - 7,
-                            start_angle + i*burst_spread,
-                            (float)t->power * 0.01);
-        }
-        if (t->bullet != MISSILE)
-            t->num_burst = 1;
-        t->bullet = MISSILE;
-        t->power = 0;
     }
+#endif
 
-    if (moved)
-        broadcast_tank_chunk(m, MOVE, id);
+    write_checkpoint(m, checkpoint_path);
+    return true;
 }
 
-void bounce_bullet(struct moag *m, int id, float hitx, float hity)
+/* Restores the game from the checkpoint at path. A missing checkpoint starts a
+ * new game, one that can't be read stops the server rather than have it
+ * written over. Held keys are let go, they belonged to the old connections.
+ */
+void load_checkpoint(struct moag *m, const char *path)
 {
-    struct bullet *b = &m->bullets[id];
-    const int ix = (int)hitx;
-    const int iy = (int)hity;
-
-    if (get_land_at(m, ix, iy) == -1)
+    FILE *f = fopen(path, "rb");
+    if (!f)
     {
-        b->obj.vel = VEC2_MUL_CONST(b->obj.vel, -1);
+        if (errno != ENOENT)
+            DIE("Can't read the checkpoint %s.\n", path);
+        LOG("No checkpoint at %s, starting a new game.\n", path);
         return;
     }
 
-    b->obj.pos = VEC2(hitx, hity);
-    b->x = ix;
-    b->y = iy;
-
-    unsigned char hit = 0;
-    if (get_land_at(m, ix - 1, iy - 1)) hit |= 1 << 7;
-    if (get_land_at(m, ix    , iy - 1)) hit |= 1 << 6;
-    if (get_land_at(m, ix + 1, iy - 1)) hit |= 1 << 5;
-    if (get_land_at(m, ix - 1, iy    )) hit |= 1 << 4;
-    if (get_land_at(m, ix + 1, iy    )) hit |= 1 << 3;
-    if (get_land_at(m, ix - 1, iy + 1)) hit |= 1 << 2;
-    if (get_land_at(m, ix    , iy + 1)) hit |= 1 << 1;
-    if (get_land_at(m, ix + 1, iy + 1)) hit |= 1;
-
-    const float IRT2 = 0.70710678;
-    const float vx = b->obj.vel.x;
-    const float vy = b->obj.vel.y;
+    uint8_t header[CHECKPOINT_HEADER_SIZE];
+    size_t pos = 4;
+    if (fread(header, sizeof header, 1, f) != 1 || memcmp(header, CHECKPOINT_MAGIC, 4) != 0 ||
+        read8(header, &pos) != CHECKPOINT_VERSION)
+        DIE("%s isn't a checkpoint this version can read.\n", path);
+    uLongf len = read32(header, &pos);
+    if (len > CHECKPOINT_MAX_SIZE)
+        DIE("Checkpoint %s is too big.\n", path);
+    for (int i = 0; i < MAX_PLAYERS; i++)
+        clients[i].host = read32(header, &pos);
+
+    long start = ftell(f);
+    fseek(f, 0, SEEK_END);
+    size_t packed_len = ftell(f) - start;
+    fseek(f, start, SEEK_SET);
+
+    uint8_t *packed = safe_malloc(packed_len);
+    uint8_t *state = safe_malloc(len);
+    uLongf unpacked_len = len;
+    if (fread(packed, packed_len, 1, f) != 1 ||
+        uncompress(state, &unpacked_len, packed, packed_len) != Z_OK ||
+        unpacked_len != len || !read_game_state(m, state, len))
+        DIE("Checkpoint %s is damaged.\n", path);
+    free(packed);
+    free(state);
+    fclose(f);
 
-    switch (hit)
+    for (int i = 0; i < MAX_PLAYERS; i++)
     {
-        case 0x00: break;
-
-        case 0x07: case 0xe0: case 0x02: case 0x40:
-            b->obj.vel.y = -vy;
-            break;
-
-        case 0x94: case 0x29: case 0x10: case 0x08:
-            b->obj.vel.x = -vx;
-            break;
-
-        case 0x16: case 0x68: case 0x04: case 0x20:
-            b->obj.vel.y = vx;
-            b->obj.vel.x = vy;
-            break;
-
-        case 0xd0: case 0x0b: case 0x80: case 0x01:
-            b->obj.vel.y = -vx;
-            b->obj.vel.x = -vy;
-            break;
-
-        case 0x17: case 0xe8: case 0x06: case 0x60:
-            b->obj.vel.x = +vx * IRT2 + vy * IRT2;
-            b->obj.vel.y = -vy * IRT2 + vx * IRT2;
-            break;
-
-        case 0x96: case 0x69: case 0x14: case 0x28:
-            b->obj.vel.x = -vx * IRT2 + vy * IRT2;
-            b->obj.vel.y = +vy * IRT2 + vx * IRT2;
-            break;
-
-        case 0xf0: case 0x0f: case 0xc0: case 0x03:
-            b->obj.vel.x = +vx * IRT2 - vy * IRT2;
-            b->obj.vel.y = -vy * IRT2 - vx * IRT2;
-            break;
+        struct player *p = &m->players[i];
+        p->kleft = p->kright = p->kup = p->kdown = p->kfire = false;
+    }
+    resume_until = m->frame + CHECKPOINT_RESUME_MS / tick_ms;
 
-        case 0xd4: case 0x2b: case 0x90: case 0x09:
-            b->obj.vel.x = -vx * IRT2 - vy * IRT2;
-            b->obj.vel.y = +vy * IRT2 - vx * IRT2;
-            break;
+    LOG("Restored the game at frame %d from %s.\n", m->frame, path);
+}
 
-        default:
-            b->obj.vel.x = -vx;
-            b->obj.vel.y = -vy;
-            break;
+/* Players restored from a checkpoint that nobody reconnected to leave. */
+static void drop_unresumed(struct moag *m)
+{
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        if (m->players[i].connected && !clients[i].peer)
+        {
+            game_leave(m, i);
+            record_bundle_entry(BUNDLE_LEAVE, i, 0, 0);
+        }
     }
 }
 
-void bullet_detonate(struct moag *m, int id)
+/* Runs a frame, and sends clients what they need to know of it. */
+void server_tick(struct moag *m)
 {
-    struct bullet *b = &m->bullets[id];
-    float d = VEC2_MAG(b->obj.vel);
-
-    if (d < 0.001 && d >- 0.001)
-        d = d < 0 ? -1 : 1;
-
-    const float dx = b->obj.vel.x / d;
-    const float dy = b->obj.vel.y / d;
+    if (m->frame == resume_until)
+        drop_unresumed(m);
 
-    float hitx = b->obj.pos.x;
-    float hity = b->obj.pos.y;
-
-    for (int i = 40; i > 0 && get_land_at(m, (int)hitx, (int)hity); i--)
+    if (lockstep || replay)
+        send_input_bundle(m);
+    step_game(m);
+    send_events(m);
+    age_inputs();
+    flush_land_dirty(m);
+    if (lockstep)
     {
-        hitx -= dx;
-        hity -= dy;
+        send_game_states(m);
     }
-
-    switch (b->type)
+    else
     {
-        case MISSILE:
-            explode(m, b->x, b->y, 12, E_EXPLODE);
-            break;
-
-        case SHOTGUN:
-            explode(m, b->x, b->y, 6, E_EXPLODE);
-            break;
-
-        case BABY_NUKE:
-            explode(m, b->x, b->y, 55, E_EXPLODE);
-            break;
-
-        case NUKE:
-            explode(m, b->x, b->y, 150, E_EXPLODE);
-            break;
-
-        case DIRT:
-            explode(m, b->x, b->y, 55, E_DIRT);
-            break;
-
-        case SUPER_DIRT:
-            explode(m, b->x, b->y, 300, E_DIRT);
-            break;
-
-        case COLLAPSE:
-            explode(m, b->x, b->y, 120, E_COLLAPSE);
-            break;
-
-        case LIQUID_DIRT:
-            for (int i = 0; i < 4; i++)
-                set_timer(m, m->frame + 65*i, LIQUID_DIRT_WARHEAD,
-                        b->x, b->y, 0, 0);
-            break;
-
-        case LIQUID_DIRT_WARHEAD:
-            liquid(m, (int)hitx, (int)hity, 2000);
-            break;
-
-        case BOUNCER:
-            if (b->active > 0)
-                b->active = -BOUNCER_BOUNCES;
-            b->active++;
-            bounce_bullet(m, id, hitx, hity);
-            b->obj.vel = VEC2_MUL_CONST(b->obj.vel, 0.9);
-            explode(m, b->x, b->y, 12, E_EXPLODE);
-            break;
-
-        case TUNNELER:
-            if (b->active > 0)
-                b->active = -TUNNELER_TUNNELINGS;
-            b->active++;
-            explode(m, hitx, hity, 9, E_EXPLODE);
-            explode(m, hitx + 8 * dx, hity + 8 * dy, 9, E_EXPLODE);
-            break;
-
-        case LADDER: {
-            int x = b->x;
-            int y = b->y;
-            for (; y < LAND_HEIGHT; y++)
-                if (get_land_at(m, x, y) == 0)
-                    break;
-            for (; y < LAND_HEIGHT; y++)
-                if (get_land_at(m, x, y))
-                    break;
-            const int maxy = y + 1;
-            y = b->y;
-            for (; y > 0; y--)
-                if (get_land_at(m, x, y) == 0)
-                    break;
-            const int miny = y;
-            for(; y < maxy; y += 2)
-            {
-                set_land_at(m, x - 1, y,     0);
-                set_land_at(m, x    , y,     1);
-                set_land_at(m, x + 1, y,     0);
-                set_land_at(m, x - 1, y + 1, 1);
-                set_land_at(m, x    , y + 1, 1);
-                set_land_at(m, x + 1, y + 1, 1);
-            }
-            broadcast_packed_land_chunk(m, x - 1, miny, 3, maxy - miny + 1);
-            break;
-        }
-
-        case MIRV:
-            bounce_bullet(m, id, hitx, hity);
-            explode(m, b->x, b->y, 12, E_EXPLODE);
-            for (int i = -3; i < 4; i++)
-                fire_bullet(m, MIRV_WARHEAD,
-                            b->x, b->y,
-                            b->obj.vel.x + i, b->obj.vel.y);
-            break;
-
-        case MIRV_WARHEAD:
-            explode(m, b->x, b->y, 30, E_EXPLODE);
-            break;
-
-        case CLUSTER_BOMB:
-            bounce_bullet(m, id, hitx, hity);
-            explode(m, b->x, b->y, 20, E_EXPLODE);
-            for (int i = 0; i < 11; i++)
-                fire_bullet(m, MISSILE, hitx, hity,
-                            2.0 * cosf(i * M_PI / 5.5) + 0.50 * b->obj.vel.x,
-                            2.0 * sinf(i * M_PI / 5.5) + 0.50 * b->obj.vel.y);
-            break;
-
-        case CLUSTER_BOUNCER:
-            bounce_bullet(m, id, hitx, hity);
-            explode(m, b->x, b->y, 20, E_EXPLODE);
-            for (int i = 0; i < 11; i++)
-                fire_bullet(m, BOUNCER, hitx, hity,
-                            2.0 * cosf(i * M_PI / 5.5) + 0.50 * b->obj.vel.x,
-                            2.0 * sinf(i * M_PI / 5.5) + 0.50 * b->obj.vel.y);
-            break;
-
-        default: break;
+        send_snapshots(m);
+        flush_bullets(m);
     }
 
-    if (b->active >= 0)
-    {
-        b->active = 0;
-        broadcast_bullet_chunk(m, KILL, id);
-    }
+    if (checkpoint_path && m->frame >= next_checkpoint && save_checkpoint(m, false))
+        next_checkpoint = m->frame + CHECKPOINT_MS / tick_ms;
 }
 
-void bullet_update(struct moag *m, int id)
+/* Joins a client to the game, or hands it a player restored from a
+ * checkpoint that's still in the game. */
+void spawn_client(struct moag *m, int id)
 {
-    struct bullet *b = &m->bullets[id];
+    bool resumed = m->players[id].connected;
 
-    if (!b->active)
-        return;
+    send_welcome_chunk(clients[id].peer, m, id, tick_ms);
 
-    if (b->type == LADDER)
+    if (!resumed)
     {
-        b->active--;
-        b->obj.pos = VEC2_ADD(b->obj.pos, b->obj.vel);
-        b->x = (int)b->obj.pos.x;
-        b->y = (int)b->obj.pos.y;
-
-        if (get_land_at(m, b->x, b->y) == 1)
-        {
-            explode(m, b->x, b->y + LADDER_LENGTH - b->active, 1, E_SAFE_EXPLODE);
-            bullet_detonate(m, id);
-        }
-        return;
+        game_join(m, id);
+        record_bundle_entry(BUNDLE_JOIN, id, 0, 0);
     }
 
-    b->obj.pos = VEC2_ADD(b->obj.pos, b->obj.vel);
-    b->obj.vel = VEC2_ADD(b->obj.vel, VEC2(0, GRAVITY));
-    b->x = (int)b->obj.pos.x;
-    b->y = (int)b->obj.pos.y;
-    if (get_land_at(m, b->x, b->y))
-    {
-        bullet_detonate(m, id);
-        return;
-    }
+    char notice[64] = "  ";
+    strcat(notice, m->players[id].name);
+    strcat(notice, " has connected");
+    broadcast_chat(-1, SERVER_NOTICE, notice, strlen(notice) + 1);
+    broadcast_chat(id, NAME_CHANGE,m->players[id].name, strlen(m->players[id].name) + 1);
 
-    if (b->active > 1)
-    {
-        b->active--;
+    clients[id].sync_x = 0;
+    clients[id].sync_y = 0;
+    clients[id].acked = 0;
+    clients[id].snapshot_interval = min_snapshot_interval;
+    clients[id].snapshot_wait = 0;
+    clients[id].input_seq = 0;
+    clients[id].input_ticks = 0;
+    clients[id].needs_state = false;
+
+    /* Lockstep clients are sent the whole game at the end of the tick, which
+     * is the only time it's all in one piece. */
+    if (lockstep)
+    {
+        clients[id].sync_y = m->land.height;
+        clients[id].needs_state = true;
         return;
     }
 
-    if (b->type == BOUNCER && b->active == 1)
-        b->active = -BOUNCER_BOUNCES;
-    if (b->type == TUNNELER && b->active == 1)
-        b->active = -TUNNELER_TUNNELINGS;
+    /* Everyone else already knows the rest of the world, only the new
+     * client is sent it. The land follows over the next few ticks. */
+    ENetPeer *peer = clients[id].peer;
+    if (m->crate.active)
+        send_crate_chunk(peer, m, SPAWN);
 
-    for (int i = 0; i < MAX_PLAYERS; i++)
+    for (int i = 0; i < MAX_PLAYERS; ++i)
     {
-        if(DIST(m->players[i].tank.x, m->players[i].tank.y - 3,
-                b->x, b->y) < 8.5)
+        if ((i != id || resumed) && m->players[i].connected)
         {
-            bullet_detonate(m, id);
-            return;
+            send_tank_chunk(peer, m, SPAWN, i);
+            send_chat(peer, i, NAME_CHANGE, m->players[i].name, strlen(m->players[i].name) + 1);
         }
     }
 
-    if (m->crate.active && DIST(m->crate.x, m->crate.y - 4, b->x, b->y) < 5.5)
-    {
-        if (m->crate.type == TRIPLER) {
-            float angle = -RAD2DEG(atan2(b->obj.vel.y, b->obj.vel.x));
-            float speed = VEC2_MAG(b->obj.vel);
-            fire_bullet_ang(m, b->type, b->x, b->y, angle - 20.0, speed);
-            fire_bullet_ang(m, b->type, b->x, b->y, angle + 20.0, speed);
-        } else if (m->crate.type == SHOTGUN) {
-            bullet_detonate(m, id);
-            float angle = -RAD2DEG(atan2(b->obj.vel.y, b->obj.vel.x));
-            float speed = VEC2_MAG(b->obj.vel);
-            int shots = SHOTGUN_PELLETS;
-            for (int i = 0; i < shots; i++)
-                fire_bullet_ang(m, m->crate.type, m->crate.x, m->crate.y - 4,
-                        angle - (shots-1)*2 + i*4, speed*0.5);
-        } else {
-            bullet_detonate(m, id);
-            fire_bullet(m, m->crate.type, m->crate.x, m->crate.y - 4,
-                           m->crate.type != BOUNCER ? 0 :
-                           b->obj.vel.x < 0 ? -0.2 :
-                                               0.2, -0.2);
-        }
-        m->crate.active = false;
-        return;
-    }
+    for (int i = 0; i < m->num_bullets; ++i)
+        if (m->bullets[m->live_bullets[i]].active)
+            send_bullet_chunk(peer, m, SPAWN, m->live_bullets[i], snapshot_seq);
+}
 
-    if (b->type == MIRV && b->obj.vel.y > 0)
-    {
-        bullet_detonate(m, id);
+void disconnect_client(struct moag *m, int id)
+{
+    /* Clients turned away for want of a slot never had one. */
+    if (id < 0)
         return;
-    }
 
-    if (b->active)
-        broadcast_bullet_chunk(m, MOVE, id);
+    clients[id].peer = NULL;
+    game_leave(m, id);
+    record_bundle_entry(BUNDLE_LEAVE, id, 0, 0);
 }
 
-void crate_update(struct moag *m)
+/* Sends the next piece of the map to a joining client: as many whole rows
+ * as fit in a piece, or part of a row when a single row doesn't. Pieces are
+ * packed when sent, so land changed since the client joined is included.
+ */
+void send_join_sync_piece(struct moag *m, struct client *c)
 {
-    if (!m->crate.active)
-    {
-        m->crate.active = true;
-        m->crate.x = rng_range(&m->rng, 20, LAND_WIDTH - 20);
-        m->crate.y = 30;
-        explode(m, m->crate.x, m->crate.y - 12, 12, E_SAFE_EXPLODE);
-
-        const int PBABYNUKE = 100;
-        const int PNUKE = 20;
-        const int PDIRT = 75;
-        const int PSUPERDIRT = 15;
-        const int PLIQUIDDIRT = 60;
-        const int PCOLLAPSE = 60;
-        const int PBOUNCER = 100;
-        const int PTUNNELER = 75;
-        const int PMIRV = 40;
-        const int PCLUSTER = 60;
-        const int PCLUSTERB = 10;
-        const int PSHOTGUN = 100;
-        const int PTRIPLER = 40;
-        // add new ones here:
-        const int TOTAL = PBABYNUKE + PNUKE + PDIRT + PSUPERDIRT + PLIQUIDDIRT +
-                          PCOLLAPSE + PBOUNCER + PTUNNELER + PMIRV + PCLUSTER +
-                          PCLUSTERB + PSHOTGUN + PTRIPLER;
-        int r = rng_range(&m->rng, 0, TOTAL);
-             if ((r -= PBABYNUKE) < 0)   m->crate.type = BABY_NUKE;
-        else if ((r -= PNUKE) < 0)       m->crate.type = NUKE;
-        else if ((r -= PSUPERDIRT) < 0)  m->crate.type = SUPER_DIRT;
-        else if ((r -= PLIQUIDDIRT) < 0) m->crate.type = LIQUID_DIRT;
-        else if ((r -= PCOLLAPSE) < 0)   m->crate.type = COLLAPSE;
-        else if ((r -= PBOUNCER) < 0)    m->crate.type = BOUNCER;
-        else if ((r -= PTUNNELER) < 0)   m->crate.type = TUNNELER;
-        else if ((r -= PMIRV) < 0)       m->crate.type = MIRV;
-        else if ((r -= PCLUSTER) < 0)    m->crate.type = CLUSTER_BOMB;
-        else if ((r -= PCLUSTERB) < 0)   m->crate.type = CLUSTER_BOUNCER;
-        else if ((r -= PSHOTGUN) < 0)    m->crate.type = SHOTGUN;
-        else if ((r -= PTRIPLER) < 0)    m->crate.type = TRIPLER;
-        else                             m->crate.type = DIRT;
-        broadcast_crate_chunk(m, SPAWN);
-    }
-
-    if (get_land_at(m, m->crate.x, m->crate.y + 1) == 0)
-    {
-        m->crate.y++;
-        broadcast_crate_chunk(m, MOVE);
+    int x = c->sync_x;
+    int y = c->sync_y;
+    int w = m->land.width - x;
+    int h = 1;
+
+    if (x == 0)
+    {
+        /* Rows packed separately are never smaller than packed together. */
+        size_t len = pack_land(m, 0, y, m->land.width, 1, NULL);
+        while (y + h < m->land.height)
+        {
+            size_t next = pack_land(m, 0, y + h, m->land.width, 1, NULL);
+            if (len + next > JOIN_SYNC_PIECE_SIZE)
+                break;
+            len += next;
+            h++;
+        }
     }
-}
 
-void timer_update(struct moag *m, int id)
-{
-    struct timer *t = &m->timers[id];
-    if (t->frame && t->frame <= m->frame)
+    if (h == 1)
+        while (w > 1 && pack_land(m, x, y, w, 1, NULL) > JOIN_SYNC_PIECE_SIZE)
+            w /= 2;
+
+    send_packed_land_chunk(c->peer, m, x, y, w, h);
+
+    c->sync_x = x + w;
+    if (c->sync_x >= m->land.width)
     {
-        fire_bullet(m, t->type, t->x, t->y, t->vx, t->vy);
-        t->frame = 0;
+        c->sync_x = 0;
+        c->sync_y = y + h;
     }
 }
 
-void step_game(struct moag *m)
+void send_join_sync(struct moag *m)
 {
-    crate_update(m);
-    for (int i = 0; i < MAX_PLAYERS; i++)
-        tank_update(m, i);
-    for (int i = 0; i < MAX_BULLETS; i++)
-        bullet_update(m, i);
-    for (int i = 0; i < MAX_TIMERS; i++)
-        timer_update(m, i);
-    m->frame += 1;
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+        struct client *c = &clients[i];
+        for (int n = 0; n < JOIN_SYNC_PIECES_PER_TICK; n++)
+        {
+            if (!c->peer || c->sync_y >= m->land.height)
+                break;
+            send_join_sync_piece(m, c);
+        }
+    }
 }
 
-intptr_t client_connect(struct moag *m)
+intptr_t client_connect(struct moag *m, ENetPeer *peer)
 {
+    /* A player restored from a checkpoint goes back to whoever it was
+     * connected from, anyone else gets a free slot. */
     intptr_t i = 0;
-    while (m->players[i].connected)
+    while (i < MAX_PLAYERS && (!m->players[i].connected || clients[i].peer ||
+                               clients[i].host != peer->address.host))
+        i++;
+    if (i == MAX_PLAYERS)
     {
-        if(++i >= MAX_PLAYERS)
+        i = 0;
+        while (m->players[i].connected)
         {
-            printf("Client failed to connect, too many clients.\n");
-            return -1;
+            if(++i >= MAX_PLAYERS)
+            {
+                printf("Client failed to connect, too many clients.\n");
+                enet_peer_disconnect(peer, 0);
+                return -1;
+            }
         }
     }
 
+    clients[i].peer = peer;
+    clients[i].host = peer->address.host;
     spawn_client(m, i);
 
     return i;
@@ -885,131 +629,289 @@ void handle_msg(struct moag *m, int id, const char* msg, int len)
         m->players[id].name[len] = '\0';
         strcat(notice, " is now known as ");
         strcat(notice, m->players[id].name);
+        if (replay)
+        {
+            ENetPacket *packet = create_chat_chunk(id, NAME_CHANGE, m->players[id].name,
+                                                   strlen(m->players[id].name) + 1);
+            record_chunk(m, packet);
+            enet_packet_destroy(packet);
+        }
         broadcast_chat(id, NAME_CHANGE, m->players[id].name, strlen(m->players[id].name) + 1);
         broadcast_chat(-1, SERVER_NOTICE, notice, strlen(notice) + 1);
     }
     else
     {
-        broadcast_chat(id, CHAT, msg, len + 1);
-    }
-}
-
-void init_game(struct moag *m)
-{
-    for (int i = 0; i < MAX_PLAYERS; i++)
-        m->players[i].connected = 0;
-    for (int i = 0; i < MAX_BULLETS; i++)
-        m->bullets[i].active = 0;
-    for (int i = 0; i < MAX_TIMERS; i++)
-        m->timers[i].frame = 0;
-    m->crate.active = false;
-    m->frame = 1;
-
-    rng_seed(&m->rng, time(NULL));
-
-    for (int y = 0; y < LAND_HEIGHT; ++y)
-    {
-        for (int x = 0; x < LAND_WIDTH; ++x)
-        {
-            if (y < LAND_HEIGHT / 3)
-                set_land_at(m, x, y, 0);
-            else
-                set_land_at(m, x, y, 1);
-        }
+        broadcast_chat(id, CHAT, msg, len);
     }
 }
 
 void on_receive(struct moag *m, ENetEvent *ev)
 {
-    struct chunk_header *chunk;
-
-    chunk = receive_chunk(ev->packet);
+    struct chunk chunk;
     intptr_t id = (intptr_t)ev->peer->data;
 
-    switch (chunk->type)
+    if (id < 0 || id >= MAX_PLAYERS || !receive_chunk(ev->packet, &chunk))
+        return;
+
+    switch (chunk.type)
     {
         case INPUT_CHUNK:
         {
-            struct input_chunk *input = (void *)chunk;
-            switch (input->key)
+            struct input_chunk *input = &chunk.input;
+            struct client *c = &clients[id];
+
+            /* Inputs are sent until they're acknowledged, only new ones are
+             * applied. */
+            uint16_t seq = input->seq;
+            size_t pos = 0;
+            struct input_entry e;
+            while (pos < input->len)
             {
-                case KLEFT_PRESSED:   m->players[id].kleft = true; break;
-                case KLEFT_RELEASED:  m->players[id].kleft = false; break;
-                case KRIGHT_PRESSED:  m->players[id].kright = true; break;
-                case KRIGHT_RELEASED: m->players[id].kright = false; break;
-                case KUP_PRESSED:     m->players[id].kup = true; break;
-                case KUP_RELEASED:    m->players[id].kup = false; break;
-                case KDOWN_PRESSED:   m->players[id].kdown = true; break;
-                case KDOWN_RELEASED:  m->players[id].kdown = false; break;
-                case KFIRE_PRESSED:   m->players[id].kfire = true; break;
-                case KFIRE_RELEASED:
+                read_input_entry(input, &pos, &e);
+                if (seq_after(seq, c->input_seq))
                 {
-                    uint16_t power = input->ms;
-                    m->players[id].kfire = false;
-                    m->players[id].tank.power = power / 2;
-                    m->players[id].tank.power = CLAMP(0, 1000, m->players[id].tank.power);
-                    break;
+                    game_input(m, id, e.key, e.ms);
+                    record_bundle_entry(BUNDLE_INPUT, id, e.key, e.ms);
+                    c->input_seq = seq;
+                    c->input_ticks = 0;
                 }
+                seq = next_seq(seq);
             }
             break;
         }
 
         case CLIENT_MSG_CHUNK:
         {
-            struct client_msg_chunk *client_msg = (void *)chunk;
-            handle_msg(m, id, (char *)client_msg->data, ev->packet->dataLength - 1);
+            struct client_msg_chunk *client_msg = &chunk.client_msg;
+            handle_msg(m, id, (const char *)client_msg->data, client_msg->len);
+            break;
+        }
+
+        case SNAPSHOT_ACK_CHUNK:
+        {
+            /* Only snapshots still kept are any use as a baseline. */
+            uint16_t seq = chunk.snapshot_ack.seq;
+            if (snapshots[seq % SNAPSHOT_HISTORY].seq == seq &&
+                (!clients[id].acked || seq_after(seq, clients[id].acked)))
+                clients[id].acked = seq;
+            break;
+        }
+
+        case STATE_REQUEST_CHUNK:
+        {
+            if (lockstep)
+                clients[id].needs_state = true;
             break;
         }
 
         default: break;
     }
-
-    free(chunk);
 }
 
-int main(int argc, char *argv[])
+void handle_event(struct moag *m, ENetEvent *event)
 {
-    init_enet_server(PORT);
+    switch (event->type)
+    {
+        case ENET_EVENT_TYPE_CONNECT:
+            LOG("Client connected.\n");
+            event->peer->data = (void *)client_connect(m, event->peer);
+            break;
 
-    LOG("Started server.\n");
+        case ENET_EVENT_TYPE_DISCONNECT:
+            LOG("Client disconnected.\n");
+            disconnect_client(m, (intptr_t)event->peer->data);
+            break;
 
-    struct moag moag;
-    init_game(&moag);
+        case ENET_EVENT_TYPE_RECEIVE:
+            on_receive(m, event);
+            enet_packet_destroy(event->packet);
+            break;
 
-    LOG("Initialized game.\n");
+        default:
+            break;
+    }
+}
 
+/* Handles packets as they arrive until the deadline, so input is applied as
+ * soon as it comes in rather than after a sleep. ENet waits in whole
+ * milliseconds, so this returns up to one late rather than spin. */
+void wait_until(struct moag *m, uint64_t deadline)
+{
     ENetEvent event;
-
     for (;;)
     {
-        while (enet_host_service(get_server_host(), &event, 0))
+        uint64_t now = monotonic_us();
+        enet_uint32 timeout = 0;
+        if (now < deadline)
+            timeout = (deadline - now + 999) / 1000;
+        int ret = enet_host_service(get_server_host(), &event, timeout);
+        if (ret > 0)
+            handle_event(m, &event);
+        else if (ret < 0 || timeout == 0)
+            return;
+    }
+}
+
+void report_ticks(void)
+{
+    if (ticks_run)
+        LOG("Ran %d ticks, %.2f ms late on average and %.2f ms at most, "
+            "%d caught up, %d dropped.\n", ticks_run,
+            total_late_us / 1000.0 / ticks_run, max_late_us / 1000.0,
+            ticks_caught_up, ticks_dropped);
+    ticks_run = ticks_caught_up = ticks_dropped = 0;
+    total_late_us = max_late_us = 0;
+}
+
+void stop_server(int sig)
+{
+    stopping = 1;
+}
+
+/* Runs ticks on a fixed schedule of the monotonic clock, so processing time
+ * doesn't slow the game down. Ticks that fall behind are run back to back,
+ * up to MAX_CATCHUP_TICKS, and any further behind are dropped. Runs until
+ * the server is told to stop, then finishes the terrain jobs and checkpoints
+ * the game. */
+void run_server(struct moag *m)
+{
+    const uint64_t tick_us = (uint64_t)tick_ms * 1000;
+    uint64_t next_tick = monotonic_us();
+    uint64_t next_report = next_tick + TICK_REPORT_MS * 1000;
+
+    while (!stopping)
+    {
+        wait_until(m, next_tick);
+
+        uint64_t now = monotonic_us();
+        for (int n = 0; n < MAX_CATCHUP_TICKS && next_tick <= now; n++)
         {
-            switch (event.type)
+            if (n > 0)
             {
-                case ENET_EVENT_TYPE_CONNECT:
-                    LOG("Client connected.\n");
-                    event.peer->data = (void *)client_connect(&moag);
+                ticks_caught_up++;
+                wait_until(m, 0);
+            }
+            uint64_t late = monotonic_us() - next_tick;
+            total_late_us += late;
+            max_late_us = MAX(max_late_us, late);
+
+            server_tick(m);
+            send_join_sync(m);
+            ticks_run++;
+            next_tick += tick_us;
+        }
+
+        if (next_tick <= now)
+        {
+            int dropped = (now - next_tick) / tick_us + 1;
+            ERR("Server is %d ticks behind, dropping them.\n", dropped);
+            ticks_dropped += dropped;
+            next_tick += (uint64_t)dropped * tick_us;
+        }
+
+        if (now >= next_report)
+        {
+            report_ticks();
+            next_report = now + TICK_REPORT_MS * 1000;
+        }
+    }
+
+    if (checkpoint_path)
+    {
+        run_terrain_jobs(m, 0);
+        save_checkpoint(m, true);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int width = DEFAULT_LAND_WIDTH;
+    int height = DEFAULT_LAND_HEIGHT;
+    uint64_t terrain_budget_us = DEFAULT_TERRAIN_BUDGET_US;
+    int tick_rate = 1000 / DEFAULT_TICK_MS;
+    int snapshot_rate = DEFAULT_SNAPSHOT_RATE;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:c:lo:r:s:t:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b':
+                terrain_budget_us = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'c':
+                checkpoint_path = optarg;
+                break;
+
+            case 'l':
+                lockstep = true;
+                break;
+
+            case 'o':
+                replay = fopen(optarg, "wb");
+                if (replay)
                     break;
+                printf("Can't write the replay to %s.\n", optarg);
+                return EXIT_FAILURE;
 
-                case ENET_EVENT_TYPE_DISCONNECT:
-                    LOG("Client disconnected.\n");
-                    disconnect_client(&moag, (intptr_t)event.peer->data);
+            case 'r':
+                snapshot_rate = atoi(optarg);
+                if (snapshot_rate > 0)
                     break;
+                printf("Snapshot rate must be at least 1 a second.\n");
+                return EXIT_FAILURE;
 
-                case ENET_EVENT_TYPE_RECEIVE:
-                    on_receive(&moag, &event);
-                    enet_packet_destroy(event.packet);
+            case 't':
+                tick_rate = atoi(optarg);
+                if (tick_rate >= 4 && tick_rate <= 1000)
                     break;
+                printf("Tick rate must be from 4 to 1000 a second.\n");
+                return EXIT_FAILURE;
 
-                default:
+            case 's':
+                if (sscanf(optarg, "%dx%d", &width, &height) == 2 &&
+                    land_size_valid(width, height))
                     break;
-            }
+                printf("Map size must be WIDTHxHEIGHT, from %dx%d to %dx%d.\n",
+                       MIN_LAND_WIDTH, MIN_LAND_HEIGHT, MAX_LAND_WIDTH, MAX_LAND_HEIGHT);
+                return EXIT_FAILURE;
+
+            default:
+                printf("usage:  %s [-b terrain budget per tick in us, 0 for none] "
+                       "[-c checkpoint file to restore from and save to] "
+                       "[-l lockstep] [-o record a replay to file] "
+                       "[-r snapshots per second] [-s map size WIDTHxHEIGHT] "
+                       "[-t ticks per second]\n", argv[0]);
+                return EXIT_FAILURE;
         }
-	SDL_Delay(10);
-
-        step_game(&moag);
     }
 
+    /* The game moves a fixed amount a tick, so the tick rate sets its speed.
+     * Snapshots are only taken as often as there are ticks. */
+    tick_ms = 1000 / tick_rate;
+    min_snapshot_interval = snapshot_interval(snapshot_rate);
+    max_snapshot_interval = MAX(min_snapshot_interval, snapshot_interval(MIN_SNAPSHOT_RATE));
+
+    init_enet_server(PORT);
+
+    LOG("Started server.\n");
+
+    struct moag moag;
+    init_game(&moag, width, height);
+    if (checkpoint_path)
+        load_checkpoint(&moag, checkpoint_path);
+    /* Clients and replays can't know how much a tick got done in time. */
+    moag.terrain_budget_us = lockstep || replay ? 0 : terrain_budget_us;
+    if (replay)
+        start_replay(&moag);
+
+    LOG("Initialized game.\n");
+
+    signal(SIGINT, stop_server);
+    signal(SIGTERM, stop_server);
+    run_server(&moag);
+
     uninit_enet();
 
     LOG("Stopped server.\n");
@@ -3,190 +3,341 @@
 #define SERVER_H
 
 #include "common.h"
+#include "game.h"
+#include "net.h"
 #include "moag.h"
 
-#define GRAVITY             0.1
-#define BOUNCER_BOUNCES     11
-#define TUNNELER_TUNNELINGS 20
-#define SHOTGUN_PELLETS     6
-#define RESPAWN_TIME        40
-#define LADDER_TIME         60
-#define LADDER_LENGTH       64
-
-enum
-{
-    MISSILE,
-    BABY_NUKE,
-    NUKE,
-    DIRT,
-    SUPER_DIRT,
-    COLLAPSE,
-    LIQUID_DIRT,
-    BOUNCER,
-    TUNNELER,
-    LADDER,
-    MIRV,
-    MIRV_WARHEAD,
-    CLUSTER_BOMB,
-    CLUSTER_BOUNCER,
-    SHOTGUN,
-    LIQUID_DIRT_WARHEAD,
-    TRIPLER,
+/* Joining clients are sent the map in pieces of at most this many packed
+ * bytes, a few pieces per tick so other players' traffic isn't starved. */
+#define JOIN_SYNC_PIECE_SIZE        1024
+#define JOIN_SYNC_PIECES_PER_TICK   4
+
+/* How often lockstep clients are sent a checksum to check their game by, and
+ * how often one is recorded in replays. */
+#define LOCKSTEP_CHECKSUM_FRAMES    5
+#define REPLAY_CHECKSUM_FRAMES      100
+
+/* Snapshots a second, unless the server is started with another rate.
+ * Clients losing more than SNAPSHOT_SLOW_LOSS of their packets, or that ENet
+ * is throttling, are sent them less often, down to MIN_SNAPSHOT_RATE, and
+ * sped back up once they lose less than SNAPSHOT_FAST_LOSS. Checked every
+ * SNAPSHOT_ADAPT_MS. */
+#define DEFAULT_SNAPSHOT_RATE       30
+#define MIN_SNAPSHOT_RATE           10
+#define SNAPSHOT_SLOW_LOSS          (ENET_PEER_PACKET_LOSS_SCALE / 20)
+#define SNAPSHOT_FAST_LOSS          (ENET_PEER_PACKET_LOSS_SCALE / 100)
+#define SNAPSHOT_ADAPT_MS           1000
+
+/* A server that was held up runs at most MAX_CATCHUP_TICKS ticks in a row to
+ * catch up, and drops any more. How late ticks ran is reported every
+ * TICK_REPORT_MS. */
+#define MAX_CATCHUP_TICKS           5
+#define TICK_REPORT_MS              10000
+
+/* Checkpoints of the game are written every CHECKPOINT_MS, without holding up
+ * the tick where the platform allows, and when the server is stopped. Players
+ * restored from one are kept for CHECKPOINT_RESUME_MS for clients to
+ * reconnect to. A checkpoint file is:
+ * 4: CHECKPOINT_MAGIC
+ * 1: CHECKPOINT_VERSION
+ * 4: length of the game, see write_game_state()
+ * 4 * MAX_PLAYERS: address each player last connected from
+ * X: the game, compressed with zlib
+ */
+#define CHECKPOINT_MS               10000
+#define CHECKPOINT_RESUME_MS        60000
+#define CHECKPOINT_MAGIC            "MOCP"
+#define CHECKPOINT_VERSION          3
+#define CHECKPOINT_HEADER_SIZE      (9 + 4 * MAX_PLAYERS)
+#define CHECKPOINT_MAX_SIZE         (64 * 1024 * 1024)
+
+/* Connection state that isn't part of the game, indexed like players. */
+struct client
+{
+    ENetPeer *peer;
+    /* Address the player last connected from. It's checkpointed, so only
+     * someone connecting from there is given the player back. */
+    uint32_t host;
+    /* Next piece of land to send while joining, sync_y is the map height
+     * once the whole map has been sent. */
+    int sync_x, sync_y;
+    /* Newest snapshot the client has, 0 for none. */
+    uint16_t acked;
+    /* Ticks between snapshots sent to the client, and until the next. */
+    int snapshot_interval, snapshot_wait;
+    /* Newest input applied, 0 for none, and the ticks stepped since, which
+     * snapshots tell the client so it can stop sending inputs up to it and
+     * replay its own tank from there. */
+    uint16_t input_seq;
+    uint16_t input_ticks;
+    /* Lockstep clients that need sending the whole game. */
+    bool needs_state;
 };
 
-enum
+static inline bool clip_land_rect(struct land *l, int *x, int *y, int *w, int *h)
 {
-    E_EXPLODE,
-    E_DIRT,
-    E_SAFE_EXPLODE,
-    E_COLLAPSE
-};
+    if (*x < 0) { *w += *x; *x = 0; }
+    if (*y < 0) { *h += *y; *y = 0; }
+    if (*x + *w > l->width) *w = l->width - *x;
+    if (*y + *h > l->height) *h = l->height - *y;
+    return *w > 0 && *h > 0;
+}
+
+static inline void write_land_header(ENetPacket *packet, size_t *pos, int type, int x, int y, int w, int h)
+{
+    write8(packet->data, pos, type);
+    write16(packet->data, pos, x);
+    write16(packet->data, pos, y);
+    write16(packet->data, pos, w);
+    write16(packet->data, pos, h);
+}
 
 static inline void broadcast_land_chunk(struct moag *m, int x, int y, int w, int h)
 {
-    if (x < 0) { w += x; x = 0; }
-    if (y < 0) { h += y; y = 0; }
-    if (x + w > LAND_WIDTH) w = LAND_WIDTH - x;
-    if (y + h > LAND_HEIGHT) h = LAND_HEIGHT - y;
-    if (w <= 0 || h <= 0 || x + w > LAND_WIDTH || y + h > LAND_HEIGHT)
+    if (!clip_land_rect(&m->land, &x, &y, &w, &h))
         return;
 
-    struct land_chunk *chunk = safe_malloc(sizeof *chunk + w * h);
-
-    chunk->_.type = LAND_CHUNK;
-    chunk->x = x;
-    chunk->y = y;
-    chunk->width = w;
-    chunk->height = h;
-
-    int i = 0;
+    size_t pos = 0;
+    ENetPacket *packet = create_packet(LAND_CHUNK_HEADER_SIZE + w * h, true);
+    write_land_header(packet, &pos, LAND_CHUNK, x, y, w, h);
     for (int yy = y; yy < h + y; ++yy)
-    {
         for (int xx = x; xx < w + x; ++xx)
-        {
-            chunk->data[i] = get_land_at(m, xx, yy);
-            i++;
-        }
-    }
-    send_chunk((void *)chunk, sizeof *chunk + w * h, true, true);
+            write8(packet->data, &pos, get_land_at(m, xx, yy));
+    broadcast_packet(CHANNEL_WORLD, packet);
 
-    LOG("%u: %s: %zu\n", (unsigned)time(NULL), __PRETTY_FUNCTION__, sizeof *chunk + w * h);
-    free(chunk);
+    LOG("%u: %s: %zu\n", (unsigned)time(NULL), __PRETTY_FUNCTION__, pos);
 }
 
-static inline void broadcast_packed_land_chunk(struct moag *m, int x, int y, int w, int h)
+static inline void send_packed_land_chunk(ENetPeer *peer, struct moag *m, int x, int y, int w, int h)
 {
-    if (x < 0) { w += x; x = 0; }
-    if (y < 0) { h += y; y = 0; }
-    if (x + w > LAND_WIDTH) w = LAND_WIDTH - x;
-    if (y + h > LAND_HEIGHT) h = LAND_HEIGHT - y;
-    if (w <= 0 || h <= 0 || x + w > LAND_WIDTH || y + h > LAND_HEIGHT)
+    if (!clip_land_rect(&m->land, &x, &y, &w, &h))
         return;
 
-    uint8_t *land = safe_malloc(w * h);
-    int i = 0;
-    for (int yy = y; yy < h + y; ++yy)
-    {
-        for (int xx = x; xx < w + x; ++xx)
-        {
-            land[i] = get_land_at(m, xx, yy);
-            i++;
-        }
-    }
-
-    size_t packed_data_len = 0;
-    uint8_t *packed_data = rlencode(land, w * h, &packed_data_len);
-    free(land);
-
-    struct packed_land_chunk *chunk = safe_malloc(sizeof *chunk + packed_data_len);
-
-    chunk->_.type = PACKED_LAND_CHUNK;
-    chunk->x = x;
-    chunk->y = y;
-    chunk->width = w;
-    chunk->height = h;
+    size_t pos = 0;
+    size_t packed_len = pack_land(m, x, y, w, h, NULL);
+    ENetPacket *packet = create_packet(LAND_CHUNK_HEADER_SIZE + packed_len, true);
+    write_land_header(packet, &pos, PACKED_LAND_CHUNK, x, y, w, h);
+    pos += pack_land(m, x, y, w, h, packet->data + pos);
+    send_packet_to(peer, CHANNEL_WORLD, packet);
 
-    for (int i = 0; i < packed_data_len; i++)
-    {
-        chunk->data[i] = packed_data[i];
-    }
-    send_chunk((void *)chunk, sizeof *chunk + packed_data_len, true, true);
+    LOG("%u: %s: %zu\n", (unsigned)time(NULL), __PRETTY_FUNCTION__, pos);
+}
 
-    LOG("%u: %s: %zu\n", (unsigned)time(NULL), __PRETTY_FUNCTION__, sizeof *chunk + packed_data_len);
-    free(packed_data);
-    free(chunk);
+static inline void broadcast_packed_land_chunk(struct moag *m, int x, int y, int w, int h)
+{
+    send_packed_land_chunk(NULL, m, x, y, w, h);
 }
 
-static inline void broadcast_tank_chunk(struct moag *m, int action, int id)
+static inline void send_tank_chunk(ENetPeer *peer, struct moag *m, int action, int id)
 {
-    struct tank_chunk chunk;
-    chunk._.type = TANK_CHUNK;
-    chunk.action = action;
-    chunk.id = id;
-    chunk.x = m->players[id].tank.x;
-    chunk.y = m->players[id].tank.y;
+    size_t pos = 0;
+    ENetPacket *packet = create_packet(TANK_CHUNK_SIZE, action == SPAWN || action == KILL);
+    write8(packet->data, &pos, TANK_CHUNK);
+    write8(packet->data, &pos, action);
+    write8(packet->data, &pos, id);
+    write16(packet->data, &pos, m->players[id].tank.x);
+    write16(packet->data, &pos, m->players[id].tank.y);
     if (m->players[id].tank.facingleft)
-        chunk.angle = -m->players[id].tank.angle;
+        write8(packet->data, &pos, -m->players[id].tank.angle);
     else
-        chunk.angle = m->players[id].tank.angle;
+        write8(packet->data, &pos, m->players[id].tank.angle);
+    send_packet_to(peer, CHANNEL_EVENTS, packet);
 
-    if (action == SPAWN || action == KILL)
-        send_chunk((void *)&chunk, sizeof chunk, true, true);
-    else
-        send_chunk((void *)&chunk, sizeof chunk, true, false);
+    LOG("%u: %s: %zu\n", (unsigned)time(NULL), __PRETTY_FUNCTION__, pos);
+}
 
-    LOG("%u: %s: %zu\n", (unsigned)time(NULL), __PRETTY_FUNCTION__, sizeof chunk);
+static inline void broadcast_tank_chunk(struct moag *m, int action, int id)
+{
+    send_tank_chunk(NULL, m, action, id);
 }
 
-static inline void broadcast_bullet_chunk(struct moag *m, int action, int id)
+/* seq is the snapshot the bullet's state is for, clients fly it from there. */
+static inline void send_bullet_chunk(ENetPeer *peer, struct moag *m, int action, int id, uint16_t seq)
 {
-    struct bullet_chunk chunk;
-    chunk._.type = BULLET_CHUNK;
-    chunk.action = action;
-    chunk.id = id;
-    chunk.x = m->bullets[id].x;
-    chunk.y = m->bullets[id].y;
+    size_t pos = 0;
+    ENetPacket *packet = create_packet(BULLET_CHUNK_SIZE, true);
+    write8(packet->data, &pos, BULLET_CHUNK);
+    write8(packet->data, &pos, action);
+    write16(packet->data, &pos, id);
+    write8(packet->data, &pos, m->bullets[id].type);
+    write16(packet->data, &pos, seq);
+    write_double(packet->data, &pos, m->bullets[id].obj.pos.x);
+    write_double(packet->data, &pos, m->bullets[id].obj.pos.y);
+    write_double(packet->data, &pos, m->bullets[id].obj.vel.x);
+    write_double(packet->data, &pos, m->bullets[id].obj.vel.y);
+    send_packet_to(peer, CHANNEL_EVENTS, packet);
+
+    LOG("%u: %s: %zu\n", (unsigned)time(NULL), __PRETTY_FUNCTION__, pos);
+}
 
-    if (action == SPAWN || action == KILL)
-        send_chunk((void *)&chunk, sizeof chunk, true, true);
-    else
-        send_chunk((void *)&chunk, sizeof chunk, true, false);
+static inline void broadcast_bullet_chunk(struct moag *m, int action, int id, uint16_t seq)
+{
+    send_bullet_chunk(NULL, m, action, id, seq);
+}
 
-    LOG("%u: %s: %zu\n", (unsigned)time(NULL), __PRETTY_FUNCTION__, sizeof chunk);
+static inline void send_crate_chunk(ENetPeer *peer, struct moag *m, int action)
+{
+    size_t pos = 0;
+    ENetPacket *packet = create_packet(CRATE_CHUNK_SIZE, action == SPAWN || action == KILL);
+    write8(packet->data, &pos, CRATE_CHUNK);
+    write8(packet->data, &pos, action);
+    write16(packet->data, &pos, m->crate.x);
+    write16(packet->data, &pos, m->crate.y);
+    send_packet_to(peer, CHANNEL_EVENTS, packet);
+
+    LOG("%u: %s: %zu\n", (unsigned)time(NULL), __PRETTY_FUNCTION__, pos);
 }
 
 static inline void broadcast_crate_chunk(struct moag *m, int action)
 {
-    struct crate_chunk chunk;
-    chunk._.type = CRATE_CHUNK;
-    chunk.action = action;
-    chunk.x = m->crate.x;
-    chunk.y = m->crate.y;
+    send_crate_chunk(NULL, m, action);
+}
 
-    if (action == SPAWN || action == KILL)
-        send_chunk((void *)&chunk, sizeof chunk, true, true);
-    else
-        send_chunk((void *)&chunk, sizeof chunk, true, false);
+static inline ENetPacket *create_chat_chunk(int id, char action, const char *msg, unsigned char len)
+{
+    size_t pos = 0;
+    ENetPacket *packet = create_packet(SERVER_MSG_CHUNK_HEADER_SIZE + len, true);
+    write8(packet->data, &pos, SERVER_MSG_CHUNK);
+    write8(packet->data, &pos, id);
+    write8(packet->data, &pos, action);
+    write_bytes(packet->data, &pos, msg, len);
+    return packet;
+}
+
+static inline void send_chat(ENetPeer *peer, int id, char action, const char *msg, unsigned char len)
+{
+    send_packet_to(peer, CHANNEL_CHAT, create_chat_chunk(id, action, msg, len));
 
-    LOG("%u: %s: %zu\n", (unsigned)time(NULL), __PRETTY_FUNCTION__, sizeof chunk);
+    LOG("%u: %s: %u\n", (unsigned)time(NULL), __PRETTY_FUNCTION__,
+        SERVER_MSG_CHUNK_HEADER_SIZE + len);
 }
 
 static inline void broadcast_chat(int id, char action, const char *msg, unsigned char len)
 {
-    struct server_msg_chunk *chunk = safe_malloc(sizeof *chunk + len);
+    send_chat(NULL, id, action, msg, len);
+}
 
-    chunk->_.type = SERVER_MSG_CHUNK;
-    chunk->id = id;
-    chunk->action = action;
+/* Writes how an entity changed since the baseline, nothing if it didn't.
+ * Positions that moved less than a byte's worth are sent as changes.
+ */
+static inline void write_snapshot_entry(unsigned char *buf, size_t *pos, int type, int id,
+                                        const struct entity_state *old,
+                                        const struct entity_state *now)
+{
+    if (!now->present)
+    {
+        if (old->present)
+        {
+            write8(buf, pos, type);
+            write8(buf, pos, id);
+            write8(buf, pos, SNAP_GONE);
+        }
+        return;
+    }
 
-    for (int i = 0; i < len; ++i)
-        chunk->data[i] = msg[i];
+    const int16_t dx = now->x - old->x;
+    const int16_t dy = now->y - old->y;
+    uint8_t fields = 0;
+    if (dx)
+        fields |= WITHIN(-128, 127, dx) ? SNAP_X8 : SNAP_X16;
+    if (dy)
+        fields |= WITHIN(-128, 127, dy) ? SNAP_Y8 : SNAP_Y16;
+    if (now->angle != old->angle)
+        fields |= SNAP_ANGLE;
+
+    if (!fields && old->present)
+        return;
 
-    send_chunk((void *)chunk, sizeof *chunk + len, true, true);
+    write8(buf, pos, type);
+    write8(buf, pos, id);
+    write8(buf, pos, fields);
+    if (fields & SNAP_X8)
+        write8(buf, pos, (uint8_t)dx);
+    else if (fields & SNAP_X16)
+        write16(buf, pos, now->x);
+    if (fields & SNAP_Y8)
+        write8(buf, pos, (uint8_t)dy);
+    else if (fields & SNAP_Y16)
+        write16(buf, pos, now->y);
+    if (fields & SNAP_ANGLE)
+        write8(buf, pos, (uint8_t)now->angle);
+}
+
+/* Sends a snapshot as changes from base, or from nothing if base is NULL. */
+static inline void send_snapshot_chunk(const struct client *c, const struct snapshot_state *now,
+                                       const struct snapshot_state *base)
+{
+    static const struct snapshot_state none;
+    const struct snapshot_state *old = base ? base : &none;
+
+    size_t pos = 0;
+    ENetPacket *packet = create_packet(SNAPSHOT_CHUNK_HEADER_SIZE +
+                                       (MAX_PLAYERS + 1) * SNAPSHOT_ENTRY_MAX_SIZE,
+                                       false);
+    write8(packet->data, &pos, SNAPSHOT_CHUNK);
+    write16(packet->data, &pos, now->seq);
+    write16(packet->data, &pos, base ? base->seq : 0);
+    write16(packet->data, &pos, now->tick);
+    write16(packet->data, &pos, c->input_seq);
+    write16(packet->data, &pos, c->input_ticks);
+    for (int i = 0; i < MAX_PLAYERS; i++)
+        write_snapshot_entry(packet->data, &pos, TANK_CHUNK, i, &old->tanks[i], &now->tanks[i]);
+    write_snapshot_entry(packet->data, &pos, CRATE_CHUNK, 0, &old->crate, &now->crate);
+    enet_packet_resize(packet, pos);
+    send_packet_to(c->peer, CHANNEL_STATE, packet);
+
+    LOG("%u: %s: %zu\n", (unsigned)time(NULL), __PRETTY_FUNCTION__, pos);
+}
+
+static inline ENetPacket *create_input_bundle_chunk(uint32_t frame, uint32_t checksum,
+                                                    const struct input_bundle_entry *entries, int n)
+{
+    size_t pos = 0;
+    ENetPacket *packet = create_packet(INPUT_BUNDLE_CHUNK_HEADER_SIZE +
+                                       n * INPUT_BUNDLE_ENTRY_SIZE, true);
+    write8(packet->data, &pos, INPUT_BUNDLE_CHUNK);
+    write32(packet->data, &pos, frame);
+    write32(packet->data, &pos, checksum);
+    for (int i = 0; i < n; i++)
+    {
+        write8(packet->data, &pos, entries[i].type);
+        write8(packet->data, &pos, entries[i].id);
+        write8(packet->data, &pos, entries[i].key);
+        write16(packet->data, &pos, entries[i].ms);
+    }
+    return packet;
+}
+
+static inline ENetPacket *create_game_state_chunk(struct moag *m)
+{
+    size_t pos = 0;
+    ENetPacket *packet = create_packet(GAME_STATE_CHUNK_HEADER_SIZE +
+                                       write_game_state(m, NULL), true);
+    write8(packet->data, &pos, GAME_STATE_CHUNK);
+    pos += write_game_state(m, packet->data + pos);
+    return packet;
+}
 
-    LOG("%u: %s: %zu\n", (unsigned)time(NULL), __PRETTY_FUNCTION__, sizeof *chunk + len);
-    free(chunk);
+static inline void send_game_state_chunk(ENetPeer *peer, struct moag *m)
+{
+    ENetPacket *packet = create_game_state_chunk(m);
+    LOG("%u: %s: %zu\n", (unsigned)time(NULL), __PRETTY_FUNCTION__, packet->dataLength);
+
+    send_packet_to(peer, CHANNEL_WORLD, packet);
 }
 
+static inline void send_welcome_chunk(ENetPeer *peer, struct moag *m, int id, int tick_ms)
+{
+    size_t pos = 0;
+    ENetPacket *packet = create_packet(WELCOME_CHUNK_SIZE, true);
+    write8(packet->data, &pos, WELCOME_CHUNK);
+    write16(packet->data, &pos, m->land.width);
+    write16(packet->data, &pos, m->land.height);
+    write8(packet->data, &pos, id);
+    write8(packet->data, &pos, tick_ms);
+    send_packet_to(peer, CHANNEL_WORLD, packet);
+
+    LOG("%u: %s: %zu\n", (unsigned)time(NULL), __PRETTY_FUNCTION__, pos);
+}
 
 #endif